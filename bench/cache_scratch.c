@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Passive false sharing test in the style of cache-scratch: the main thread allocates a small
+// object for each thread, which frees it and then repeatedly allocates an object of the same size
+// and writes to it. Allocators handing out neighbouring slots to different threads make the
+// threads contend on the same cache lines.
+
+#define THREADS 4
+#define ITERATIONS 2000
+#define REPETITIONS 5000
+#define OBJECT_SIZE 8
+
+static void *work(void *arg) {
+    free(arg);
+    for (unsigned i = 0; i < ITERATIONS; i++) {
+        volatile char *p = malloc(OBJECT_SIZE);
+        if (p == NULL) {
+            abort();
+        }
+        for (unsigned j = 0; j < REPETITIONS; j++) {
+            for (unsigned k = 0; k < OBJECT_SIZE; k++) {
+                p[k]++;
+            }
+        }
+        free((void *)p);
+    }
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[THREADS];
+    for (unsigned t = 0; t < THREADS; t++) {
+        void *object = malloc(OBJECT_SIZE);
+        if (object == NULL || pthread_create(&threads[t], NULL, work, object)) {
+            return 1;
+        }
+    }
+    for (unsigned t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// String and container heavy workload: building and tearing down maps of strings to vectors, with
+// growth through reallocation and many small node allocations.
+
+int main() {
+    uint64_t rng = 1;
+    auto next = [&rng] {
+        rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+        return rng >> 33;
+    };
+
+    size_t total = 0;
+    for (int round = 0; round < 40; round++) {
+        std::map<std::string, std::vector<int>> ordered;
+        std::unordered_map<std::string, std::shared_ptr<std::string>> index;
+        for (int i = 0; i < 20000; i++) {
+            std::string key = "key-" + std::to_string(next() % 50000);
+            auto &values = ordered[key];
+            for (uint64_t j = next() % 32; j > 0; j--) {
+                values.push_back(static_cast<int>(j));
+            }
+            index[key] = std::make_shared<std::string>(key + std::string(next() % 200, 'x'));
+        }
+
+        std::vector<std::string> words;
+        for (const auto &entry : ordered) {
+            words.push_back(entry.first + ":" + std::to_string(entry.second.size()));
+        }
+        for (const auto &word : words) {
+            total += word.size();
+        }
+        for (int i = 0; i < 10000; i++) {
+            index.erase("key-" + std::to_string(next() % 50000));
+        }
+        total += index.size();
+    }
+    return total == 0;
+}
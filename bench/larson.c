@@ -0,0 +1,70 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Server simulation in the style of the Larson benchmark: each thread replaces random slots in its
+// share of a table with new allocations of random sizes, and hands its share to a new thread
+// after a number of rounds, so objects get freed by threads other than the one allocating them.
+
+#define THREADS 4
+#define SLOTS_PER_THREAD 1000
+#define ROUNDS_PER_THREAD 200000
+#define GENERATIONS 10
+#define MIN_SIZE 8
+#define MAX_SIZE 1000
+
+struct worker {
+    void **slots;
+    uint64_t rng;
+};
+
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    for (unsigned i = 0; i < ROUNDS_PER_THREAD; i++) {
+        size_t index = next(&w->rng) % SLOTS_PER_THREAD;
+        size_t size = MIN_SIZE + next(&w->rng) % (MAX_SIZE - MIN_SIZE);
+        free(w->slots[index]);
+        w->slots[index] = malloc(size);
+        if (w->slots[index] == NULL) {
+            abort();
+        }
+        memset(w->slots[index], (int)i, size < 32 ? size : 32);
+    }
+    return NULL;
+}
+
+int main(void) {
+    static void *table[THREADS * SLOTS_PER_THREAD];
+    struct worker workers[THREADS];
+    for (unsigned t = 0; t < THREADS; t++) {
+        workers[t].slots = table + t * SLOTS_PER_THREAD;
+        workers[t].rng = t + 1;
+    }
+
+    for (unsigned generation = 0; generation < GENERATIONS; generation++) {
+        pthread_t threads[THREADS];
+        for (unsigned t = 0; t < THREADS; t++) {
+            if (pthread_create(&threads[t], NULL, work, &workers[t])) {
+                return 1;
+            }
+        }
+        for (unsigned t = 0; t < THREADS; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        free(table[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,279 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../malloc.h"
+
+// Tail latency harness, linked with an allocator built with H_MALLOC_PREFIX and SLOW_PATH_TRACE.
+// Every malloc and free is timed into a log-linear histogram for its size class, operation and the
+// slow path taken during it (if any), found by comparing the per-thread slow path counts before
+// and after the operation. The threads all churn the same size class at once, for each thread
+// count given on the command line (default: 1 and 4).
+//
+// Output is tab-separated, in cycles on x86 and nanoseconds elsewhere:
+//
+// latency <threads> <size> <op> <count> <p50> <p99> <p99.9> <max>
+// outliers <threads> <size> <op> <cause> <count of operations at or above p99.9>
+
+#define SLOTS 512
+#define OPERATIONS 100000
+#define BULK_FREE_INTERVAL 20000
+#define MAX_THREADS 64
+
+// 16 linear sub-buckets for each power of 2
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+#define OP_MALLOC 0
+#define OP_FREE 1
+#define OPS 2
+
+// no slow path, a slow path or more than one
+#define CAUSES (H_MALLOC_SLOW_PATHS + 2)
+#define CAUSE_NONE H_MALLOC_SLOW_PATHS
+#define CAUSE_MULTIPLE (H_MALLOC_SLOW_PATHS + 1)
+
+static const char *const op_names[OPS] = {"malloc", "free"};
+static const char *const cause_names[CAUSES] = {
+    "metadata", "reactivate", "purge", "regions_grow", "reseed", "quarantine_batch", "none",
+    "multiple"
+};
+
+static const size_t sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    // large allocations
+    65536
+};
+
+struct histogram {
+    uint64_t counts[CAUSES][OPS][BUCKETS];
+};
+
+struct worker {
+    size_t size;
+    uint64_t rng;
+    struct histogram histogram;
+};
+
+static uint64_t now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static size_t bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    return ((msb - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) +
+        ((value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// lowest value in the bucket
+static uint64_t bucket_value(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    unsigned msb = (index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+    return (uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << (msb - SUB_BUCKET_BITS);
+}
+
+static size_t find_cause(const uint64_t *before, const uint64_t *after) {
+    size_t cause = CAUSE_NONE;
+    for (size_t i = 0; i < H_MALLOC_SLOW_PATHS; i++) {
+        if (before[i] != after[i]) {
+            cause = cause == CAUSE_NONE ? i : CAUSE_MULTIPLE;
+        }
+    }
+    return cause;
+}
+
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void record(struct worker *w, size_t op, uint64_t start, uint64_t end, uint64_t *slow) {
+    uint64_t after[H_MALLOC_SLOW_PATHS];
+    h_malloc_slow_paths(after);
+    w->histogram.counts[find_cause(slow, after)][op][bucket_index(end - start)]++;
+    memcpy(slow, after, sizeof(after));
+}
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    void *slots[SLOTS] = {NULL};
+    uint64_t slow[H_MALLOC_SLOW_PATHS];
+    h_malloc_slow_paths(slow);
+
+    // sizes with room for the canary, so they stay in the size class
+    size_t size = w->size - 8;
+
+    for (unsigned i = 1; i <= OPERATIONS; i++) {
+        size_t index = next(&w->rng) % SLOTS;
+        if (slots[index] == NULL) {
+            uint64_t start = now();
+            slots[index] = h_malloc(size);
+            uint64_t end = now();
+            if (slots[index] == NULL) {
+                abort();
+            }
+            record(w, OP_MALLOC, start, end, slow);
+        } else {
+            uint64_t start = now();
+            h_free(slots[index]);
+            uint64_t end = now();
+            slots[index] = NULL;
+            record(w, OP_FREE, start, end, slow);
+        }
+
+        // emptying the slabs periodically exercises purging and reactivation
+        if (i % BULK_FREE_INTERVAL == 0) {
+            for (size_t j = 0; j < SLOTS; j++) {
+                if (slots[j] != NULL) {
+                    uint64_t start = now();
+                    h_free(slots[j]);
+                    uint64_t end = now();
+                    slots[j] = NULL;
+                    record(w, OP_FREE, start, end, slow);
+                }
+            }
+        }
+    }
+
+    for (size_t j = 0; j < SLOTS; j++) {
+        h_free(slots[j]);
+    }
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t *counts, uint64_t total, double fraction) {
+    uint64_t target = (uint64_t)(total * fraction);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > target) {
+            return bucket_value(i);
+        }
+    }
+    return 0;
+}
+
+static void report(unsigned threads, size_t size, struct histogram *merged) {
+    for (size_t op = 0; op < OPS; op++) {
+        uint64_t counts[BUCKETS] = {0};
+        uint64_t total = 0;
+        size_t max = 0;
+        for (size_t cause = 0; cause < CAUSES; cause++) {
+            for (size_t i = 0; i < BUCKETS; i++) {
+                counts[i] += merged->counts[cause][op][i];
+                total += merged->counts[cause][op][i];
+                if (merged->counts[cause][op][i] && i > max) {
+                    max = i;
+                }
+            }
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        uint64_t p999 = percentile(counts, total, 0.999);
+        printf("latency\t%u\t%zu\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\n", threads, size, op_names[op],
+               (unsigned long)total, (unsigned long)percentile(counts, total, 0.5),
+               (unsigned long)percentile(counts, total, 0.99), (unsigned long)p999,
+               (unsigned long)bucket_value(max));
+
+        for (size_t cause = 0; cause < CAUSES; cause++) {
+            uint64_t outliers = 0;
+            for (size_t i = bucket_index(p999); i < BUCKETS; i++) {
+                outliers += merged->counts[cause][op][i];
+            }
+            if (outliers) {
+                printf("outliers\t%u\t%zu\t%s\t%s\t%lu\n", threads, size, op_names[op],
+                       cause_names[cause], (unsigned long)outliers);
+            }
+        }
+    }
+}
+
+static void run(unsigned threads, size_t size) {
+    static struct worker workers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+
+    for (unsigned t = 0; t < threads; t++) {
+        memset(&workers[t].histogram, 0, sizeof(workers[t].histogram));
+        workers[t].size = size;
+        workers[t].rng = t + 1;
+        if (pthread_create(&ids[t], NULL, work, &workers[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+
+    static struct histogram merged;
+    memset(&merged, 0, sizeof(merged));
+    for (unsigned t = 0; t < threads; t++) {
+        for (size_t cause = 0; cause < CAUSES; cause++) {
+            for (size_t op = 0; op < OPS; op++) {
+                for (size_t i = 0; i < BUCKETS; i++) {
+                    merged.counts[cause][op][i] += workers[t].histogram.counts[cause][op][i];
+                }
+            }
+        }
+    }
+    report(threads, size, &merged);
+}
+
+int main(int argc, char **argv) {
+    unsigned default_threads[] = {1, 4};
+    unsigned *thread_counts = default_threads;
+    size_t n_thread_counts = 2;
+
+    if (argc > 1) {
+        thread_counts = calloc(argc - 1, sizeof(unsigned));
+        if (thread_counts == NULL) {
+            return 1;
+        }
+        n_thread_counts = argc - 1;
+        for (int i = 1; i < argc; i++) {
+            thread_counts[i - 1] = strtoul(argv[i], NULL, 10);
+            if (thread_counts[i - 1] == 0 || thread_counts[i - 1] > MAX_THREADS) {
+                fprintf(stderr, "thread count must be between 1 and %d\n", MAX_THREADS);
+                return 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n_thread_counts; i++) {
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            run(thread_counts[i], sizes[j]);
+        }
+    }
+    return 0;
+}
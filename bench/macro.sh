@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Runs the macro benchmarks against the system allocator, hardened_malloc through preload.sh and
+# any other allocator found through ldconfig, printing a tab-separated table with a header line.
+# Each benchmark is run once for the wall time and maximum RSS and once more under ptrace to
+# count the system calls.
+
+set -o errexit -o nounset -o pipefail
+
+dir="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+benchmarks=(larson xmalloc cache_scratch sh6bench containers)
+allocators=(system hardened_malloc)
+declare -A libraries
+
+for library in libjemalloc.so.2 libtcmalloc_minimal.so.4 libtcmalloc.so.4 libmimalloc.so.2; do
+    path="$(ldconfig -p 2>/dev/null | awk -v name="$library" '$1 == name { print $NF; exit }')"
+    if [[ $path ]]; then
+        allocators+=("${library%%.so*}")
+        libraries["${library%%.so*}"]="$path"
+    fi
+done
+
+run() {
+    local mode=$1 allocator=$2 benchmark=$3
+    case $allocator in
+        system) "$dir/measure" "$mode" "$dir/$benchmark" ;;
+        hardened_malloc) "$dir/measure" "$mode" "$dir/../preload.sh" "$dir/$benchmark" ;;
+        *) "$dir/measure" "$mode" env LD_PRELOAD="${libraries[$allocator]}" "$dir/$benchmark" ;;
+    esac
+}
+
+printf "benchmark\tallocator\twall_s\tmax_rss_kib\tsyscalls\tmmap\tmunmap\tmprotect\tmadvise\tmremap\tbrk\tfutex\n"
+for benchmark in "${benchmarks[@]}"; do
+    for allocator in "${allocators[@]}"; do
+        time="$(run time "$allocator" "$benchmark")"
+        syscalls="$(run syscalls "$allocator" "$benchmark")"
+        printf "%s\t%s\t%s\t%s\n" "$benchmark" "$allocator" "$time" "$syscalls"
+    done
+done
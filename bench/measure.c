@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+// Runs a command and prints tab-separated measurements for it:
+//
+// measure time <command>: wall time in seconds and maximum RSS in KiB
+// measure syscalls <command>: total system calls, then the memory management and futex calls
+//
+// System calls are counted by tracing every thread with ptrace, which slows the command down
+// heavily, so the two are measured in separate runs.
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int run_time(char **argv) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        perror("execvp");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return 1;
+    }
+    double wall = elapsed(&start);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "command failed with status %d\n", status);
+        return 1;
+    }
+    printf("%.3f\t%ld\n", wall, usage.ru_maxrss);
+    return 0;
+}
+
+static const long counted[] = {
+    SYS_mmap, SYS_munmap, SYS_mprotect, SYS_madvise, SYS_mremap, SYS_brk, SYS_futex
+};
+
+#define N_COUNTED (sizeof(counted) / sizeof(counted[0]))
+
+static long get_syscall_number(pid_t tid) {
+#if defined(__x86_64__)
+    struct user_regs_struct regs;
+    if (ptrace(PTRACE_GETREGS, tid, NULL, &regs)) {
+        return -1;
+    }
+    return regs.orig_rax;
+#elif defined(__aarch64__)
+    struct user_regs_struct regs;
+    struct iovec iov = {&regs, sizeof(regs)};
+    if (ptrace(PTRACE_GETREGSET, tid, (void *)NT_PRSTATUS, &iov)) {
+        return -1;
+    }
+    return regs.regs[8];
+#else
+#error "system call counting is only implemented for x86_64 and arm64"
+#endif
+}
+
+static int run_syscalls(char **argv) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(argv[0], argv);
+        perror("execvp");
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        fputs("failed to trace command\n", stderr);
+        return 1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+        PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)options)) {
+        perror("ptrace");
+        return 1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // syscall-stops alternate between entry and exit for each thread, and only the entries are
+    // counted, tracked by a bit per thread id
+    static uint8_t in_syscall[4 * 1024 * 1024 / 8];
+    uint64_t total = 0;
+    uint64_t counts[N_COUNTED] = {0};
+    int exit_status = 1;
+
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) {
+            if (errno == ECHILD) {
+                break;
+            }
+            perror("waitpid");
+            return 1;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) {
+                exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
+            continue;
+        }
+
+        int signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            size_t bit = (size_t)tid % (sizeof(in_syscall) * 8);
+            in_syscall[bit / 8] ^= 1 << (bit % 8);
+            if (in_syscall[bit / 8] & (1 << (bit % 8))) {
+                long number = get_syscall_number(tid);
+                total++;
+                for (size_t i = 0; i < N_COUNTED; i++) {
+                    if (number == counted[i]) {
+                        counts[i]++;
+                    }
+                }
+            }
+        } else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP) {
+            // deliver real signals, but not the stops from attaching to new threads
+            signal = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)signal);
+    }
+
+    if (exit_status) {
+        fprintf(stderr, "command failed with status %d\n", exit_status);
+        return 1;
+    }
+    printf("%lu", (unsigned long)total);
+    for (size_t i = 0; i < N_COUNTED; i++) {
+        printf("\t%lu", (unsigned long)counts[i]);
+    }
+    putchar('\n');
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fputs("usage: measure time|syscalls command [args...]\n", stderr);
+        return 1;
+    }
+    if (!strcmp(argv[1], "time")) {
+        return run_time(argv + 2);
+    }
+    if (!strcmp(argv[1], "syscalls")) {
+        return run_syscalls(argv + 2);
+    }
+    fputs("usage: measure time|syscalls command [args...]\n", stderr);
+    return 1;
+}
@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Long-running memory overhead benchmark, run against the system allocator or through
+// preload.sh. It cycles through phases of growth, steady churn and shrinking, sampling the
+// process memory usage at an interval and printing tab-separated lines:
+//
+// <seconds> <phase> <live bytes> <RSS KiB> <PSS KiB> <mappings> <allocator metadata bytes>
+//
+// The metadata is taken from the malloc_info total reported by hardened_malloc and is - for
+// other allocators.
+//
+// overhead [duration in seconds] [sample interval in milliseconds] [cycles]
+
+#define SLOTS 65536
+#define CHECK_INTERVAL 1024
+
+enum phase {
+    GROWTH,
+    CHURN,
+    SHRINK,
+    PHASES
+};
+
+static const char *const phase_names[PHASES] = {"growth", "churn", "shrink"};
+
+// chance out of 8 to allocate into an empty slot rather than free an allocation
+static const unsigned phase_alloc_chance[PHASES] = {6, 4, 1};
+
+static void *slots[SLOTS];
+static size_t sizes[SLOTS];
+static size_t live;
+
+// kept out of the heap to avoid perturbing the measurements
+static char buffer[1024 * 1024];
+
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// mostly small allocations, with a tail of large ones exercising the guards and the region table
+static size_t random_size(uint64_t *state) {
+    uint64_t r = next(state);
+    switch (r % 64) {
+    case 0:
+        return 16385 + (r >> 8) % (512 * 1024);
+    case 1: case 2: case 3:
+        return 1025 + (r >> 8) % 15360;
+    case 4: case 5: case 6: case 7: case 8: case 9:
+        return 129 + (r >> 8) % 896;
+    default:
+        return 1 + (r >> 8) % 128;
+    }
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static ssize_t read_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t length = 0;
+    for (;;) {
+        ssize_t n = read(fd, buffer + length, sizeof(buffer) - 1 - length);
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    }
+    close(fd);
+    buffer[length] = '\0';
+    return length;
+}
+
+static unsigned long read_field(const char *name) {
+    char *p = strstr(buffer, name);
+    return p ? strtoul(p + strlen(name), NULL, 10) : 0;
+}
+
+static void sample(double seconds, enum phase phase) {
+    unsigned long rss = 0, pss = 0;
+    if (read_file("/proc/self/smaps_rollup") != -1) {
+        rss = read_field("\nRss:");
+        pss = read_field("\nPss:");
+    }
+
+    unsigned long mappings = 0;
+    if (read_file("/proc/self/maps") != -1) {
+        for (char *p = buffer; (p = strchr(p, '\n')) != NULL; p++) {
+            mappings++;
+        }
+    }
+
+    char metadata[32] = "-";
+    FILE *fp = fmemopen(buffer, sizeof(buffer) - 1, "w");
+    if (fp != NULL) {
+        int ret = malloc_info(0, fp);
+        fclose(fp);
+        buffer[sizeof(buffer) - 1] = '\0';
+        char *p = strstr(buffer, "<total type=\"metadata\" size=\"");
+        if (ret == 0 && p != NULL) {
+            snprintf(metadata, sizeof(metadata), "%lu",
+                     strtoul(p + strlen("<total type=\"metadata\" size=\""), NULL, 10));
+        }
+    }
+
+    printf("%.1f\t%s\t%zu\t%lu\t%lu\t%lu\t%s\n", seconds, phase_names[phase], live, rss, pss,
+           mappings, metadata);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    double duration = argc > 1 ? strtod(argv[1], NULL) : 180;
+    double interval = (argc > 2 ? strtod(argv[2], NULL) : 1000) / 1000;
+    unsigned cycles = argc > 3 ? strtoul(argv[3], NULL, 10) : 3;
+    if (duration <= 0 || interval <= 0 || cycles == 0) {
+        fprintf(stderr, "usage: %s [seconds] [sample interval ms] [cycles]\n", argv[0]);
+        return 1;
+    }
+    double phase_duration = duration / (cycles * PHASES);
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double next_sample = 0;
+
+    for (unsigned cycle = 0; cycle < cycles; cycle++) {
+        for (enum phase phase = 0; phase < PHASES; phase++) {
+            double phase_end = (cycle * PHASES + phase + 1) * phase_duration;
+            for (;;) {
+                double seconds = elapsed(&start);
+                if (seconds >= next_sample) {
+                    sample(seconds, phase);
+                    next_sample += interval;
+                }
+                if (seconds >= phase_end) {
+                    break;
+                }
+
+                for (unsigned i = 0; i < CHECK_INTERVAL; i++) {
+                    uint64_t r = next(&state);
+                    size_t index = r % SLOTS;
+                    bool allocate = (r >> 32) % 8 < phase_alloc_chance[phase];
+                    if (allocate && slots[index] == NULL) {
+                        size_t size = random_size(&state);
+                        slots[index] = malloc(size);
+                        if (slots[index] == NULL) {
+                            abort();
+                        }
+                        memset(slots[index], 0xa5, size);
+                        sizes[index] = size;
+                        live += size;
+                    } else if (!allocate && slots[index] != NULL) {
+                        free(slots[index]);
+                        slots[index] = NULL;
+                        live -= sizes[index];
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; i++) {
+        free(slots[i]);
+    }
+    live = 0;
+    sample(elapsed(&start), SHRINK);
+    return 0;
+}
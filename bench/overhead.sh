@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# Runs the memory overhead benchmark against the system allocator and hardened_malloc through
+# preload.sh, printing the samples from both as a tab-separated table with a header line. The
+# arguments are passed through to the benchmark.
+
+set -o errexit -o nounset -o pipefail
+
+dir="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+
+printf "allocator\tseconds\tphase\tlive_bytes\trss_kib\tpss_kib\tmappings\tmetadata_bytes\n"
+"$dir/overhead" "$@" | sed "s/^/system\t/"
+"$dir/../preload.sh" "$dir/overhead" "$@" | sed "s/^/hardened_malloc\t/"
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../malloc.h"
+
+// Thread scaling and churn benchmark, linked with an allocator built with H_MALLOC_PREFIX and
+// LOCK_CONTENTION_TRACE. The same per-thread workload is run with 1 up to twice the number of
+// processors, and then as storms of short-lived threads. Each run is followed by the locks it
+// contended, as tab-separated lines:
+//
+// scaling <threads> <operations per second> <operations per second per thread>
+// churn <concurrent threads> <threads created> <threads per second> <operations per second> <RSS KiB>
+// contention <workload> <threads> <slot size, or large> <acquired> <contended> <contended %>
+//
+// scaling [max threads]
+
+#define MAX_THREADS 256
+#define SLOTS 1024
+#define SCALING_OPERATIONS 400000
+#define CHURN_OPERATIONS 2000
+#define CHURN_THREADS 2000
+
+// size classes, then the large allocations
+#define LOCKS 64
+
+struct lock_counts {
+    uint64_t acquired[LOCKS];
+    uint64_t contended[LOCKS];
+    size_t size[LOCKS];
+    size_t count;
+};
+
+struct worker {
+    uint64_t seed;
+    unsigned operations;
+};
+
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static size_t random_size(uint64_t r) {
+    switch (r % 32) {
+    case 0:
+        return 16385 + (r >> 8) % (128 * 1024);
+    case 1: case 2:
+        return 1025 + (r >> 8) % 15360;
+    case 3: case 4: case 5: case 6:
+        return 129 + (r >> 8) % 896;
+    default:
+        return 1 + (r >> 8) % 128;
+    }
+}
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    uint64_t state = w->seed;
+    void *slots[SLOTS] = {NULL};
+
+    for (unsigned i = 0; i < w->operations; i++) {
+        uint64_t r = next(&state);
+        size_t index = r % SLOTS;
+        if (slots[index] != NULL) {
+            h_free(slots[index]);
+            slots[index] = NULL;
+        } else {
+            size_t size = random_size(r >> 16);
+            slots[index] = h_malloc(size);
+            if (slots[index] == NULL) {
+                abort();
+            }
+            memset(slots[index], 0xa5, size < 64 ? size : 64);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; i++) {
+        h_free(slots[i]);
+    }
+    return NULL;
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void read_locks(struct lock_counts *counts) {
+    struct h_malloc_lock_contention contention;
+    size_t i = 0;
+    for (; i < LOCKS - 1 && !h_malloc_lock_contention(i, &contention); i++) {
+        counts->acquired[i] = contention.acquired;
+        counts->contended[i] = contention.contended;
+        counts->size[i] = contention.size;
+    }
+    h_malloc_lock_contention(H_MALLOC_LARGE_CLASS, &contention);
+    counts->acquired[i] = contention.acquired;
+    counts->contended[i] = contention.contended;
+    counts->size[i] = 0;
+    counts->count = i + 1;
+}
+
+static void report_locks(const char *workload, unsigned threads, const struct lock_counts *before) {
+    struct lock_counts after;
+    read_locks(&after);
+    for (size_t i = 0; i < after.count; i++) {
+        uint64_t acquired = after.acquired[i] - before->acquired[i];
+        uint64_t contended = after.contended[i] - before->contended[i];
+        if (contended == 0) {
+            continue;
+        }
+        // the large allocations come last
+        if (i == after.count - 1) {
+            printf("contention\t%s\t%u\tlarge", workload, threads);
+        } else {
+            printf("contention\t%s\t%u\t%zu", workload, threads, after.size[i]);
+        }
+        printf("\t%lu\t%lu\t%.2f\n", (unsigned long)acquired, (unsigned long)contended,
+               100.0 * contended / acquired);
+    }
+}
+
+static unsigned long rss_kib(void) {
+    unsigned long size, pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%lu %lu", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void scaling(unsigned threads) {
+    static struct worker workers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    struct lock_counts before;
+    read_locks(&before);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned t = 0; t < threads; t++) {
+        workers[t].seed = t + 1;
+        workers[t].operations = SCALING_OPERATIONS;
+        if (pthread_create(&ids[t], NULL, work, &workers[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double seconds = elapsed(&start);
+
+    double throughput = (double)SCALING_OPERATIONS * threads / seconds;
+    printf("scaling\t%u\t%.0f\t%.0f\n", threads, throughput, throughput / threads);
+    report_locks("scaling", threads, &before);
+}
+
+// Keeps the given number of threads running, replacing each one as it exits, until CHURN_THREADS
+// have been created. The threads are joined in creation order.
+static void churn(unsigned concurrent) {
+    static struct worker workers[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    struct lock_counts before;
+    read_locks(&before);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned created = 0; created < CHURN_THREADS; created++) {
+        unsigned t = created % concurrent;
+        if (created >= concurrent) {
+            pthread_join(ids[t], NULL);
+        }
+        workers[t].seed = created + 1;
+        workers[t].operations = CHURN_OPERATIONS;
+        if (pthread_create(&ids[t], NULL, work, &workers[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned t = 0; t < concurrent && t < CHURN_THREADS; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double seconds = elapsed(&start);
+
+    printf("churn\t%u\t%u\t%.0f\t%.0f\t%lu\n", concurrent, CHURN_THREADS, CHURN_THREADS / seconds,
+           (double)CHURN_OPERATIONS * CHURN_THREADS / seconds, rss_kib());
+    report_locks("churn", concurrent, &before);
+}
+
+int main(int argc, char **argv) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_threads = processors > 0 ? 2 * processors : 2;
+    if (argc > 1) {
+        max_threads = strtoul(argv[1], NULL, 10);
+    }
+    if (max_threads == 0 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "thread count must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    // doubling up to the maximum, which is always included
+    for (unsigned threads = 1;; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        scaling(threads);
+        churn(threads);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    return 0;
+}
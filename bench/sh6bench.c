@@ -0,0 +1,46 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mixed size workload in the style of sh6bench: batches of allocations with sizes spread over a
+// wide range, freed partly in allocation order, partly in reverse order and partly left behind
+// for a later batch.
+
+#define BATCH 2000
+#define ROUNDS 800
+#define MAX_SIZE 8000
+
+int main(void) {
+    static void *kept[BATCH];
+    void *batch[BATCH];
+    uint64_t rng = 1;
+
+    for (unsigned round = 0; round < ROUNDS; round++) {
+        for (unsigned i = 0; i < BATCH; i++) {
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            size_t size = 1 + (rng >> 33) % ((rng >> 62) ? 128 : MAX_SIZE);
+            batch[i] = malloc(size);
+            if (batch[i] == NULL) {
+                return 1;
+            }
+            memset(batch[i], 0, size < 64 ? size : 64);
+        }
+
+        // FIFO for the first third, LIFO for the second and the rest replaces the previous batch
+        for (unsigned i = 0; i < BATCH / 3; i++) {
+            free(batch[i]);
+        }
+        for (unsigned i = 2 * BATCH / 3; i-- > BATCH / 3;) {
+            free(batch[i]);
+        }
+        for (unsigned i = 2 * BATCH / 3; i < BATCH; i++) {
+            free(kept[i]);
+            kept[i] = batch[i];
+        }
+    }
+
+    for (unsigned i = 0; i < BATCH; i++) {
+        free(kept[i]);
+    }
+    return 0;
+}
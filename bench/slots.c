@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../malloc.h"
+
+// Slot selection benchmark, linked with an allocator built with H_MALLOC_PREFIX. For each size
+// class, slabs are filled and then refilled after freeing a random half of the slots, measuring:
+//
+// cycles: cycles per malloc for the refill, dominated by choosing a free slot in a partial slab
+// adjacent: fraction of refill allocations placed in the slot right after the previous one
+//
+// With uniform random slot selection, the next slot is never more likely than any other free
+// slot, so the adjacent fraction stays close to the inverse of the free slots in the slab. A
+// search from a random start point picks the slot after the previous one far more often.
+//
+// The counts are cycles on x86 and nanoseconds elsewhere. Output is one line per size class:
+// "<size> <cycles> <adjacent>".
+
+#define COUNT 100000
+
+static const size_t size_classes[] = {16, 64, 256, 1024, 4096};
+
+static void *p[COUNT];
+
+static uint64_t now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int main(void) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+    for (size_t i = 0; i < sizeof(size_classes) / sizeof(size_classes[0]); i++) {
+        size_t size = size_classes[i];
+        // sizes with room for the canary, so they stay in the size class
+        size_t request = size - 8;
+
+        for (size_t j = 0; j < COUNT; j++) {
+            p[j] = h_malloc(request);
+        }
+
+        size_t freed = 0;
+        for (size_t j = 0; j < COUNT; j++) {
+            if (next(&state) & 1) {
+                h_free(p[j]);
+                p[j] = NULL;
+                freed++;
+            }
+        }
+
+        size_t adjacent = 0;
+        char *previous = NULL;
+        uint64_t start = now();
+        for (size_t j = 0; j < COUNT; j++) {
+            if (p[j] == NULL) {
+                p[j] = h_malloc(request);
+                if ((char *)p[j] == previous + size) {
+                    adjacent++;
+                }
+                previous = p[j];
+            }
+        }
+        uint64_t cycles = now() - start;
+
+        printf("%zu\t%.1f\t%.4f\n", size, (double)cycles / freed, (double)adjacent / freed);
+
+        for (size_t j = 0; j < COUNT; j++) {
+            h_free(p[j]);
+        }
+    }
+    return 0;
+}
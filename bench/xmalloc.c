@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cross-thread free in the style of xmalloc-test: producer threads allocate objects and pass them
+// in batches through a shared queue to consumer threads, which free them.
+
+#define PAIRS 2
+#define BATCH 256
+#define BATCHES_PER_PRODUCER 4000
+#define QUEUE_LENGTH 64
+
+struct batch {
+    void *objects[BATCH];
+};
+
+static struct batch *queue[QUEUE_LENGTH];
+static size_t head, count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+
+static void push(struct batch *b) {
+    pthread_mutex_lock(&lock);
+    while (count == QUEUE_LENGTH) {
+        pthread_cond_wait(&not_full, &lock);
+    }
+    queue[(head + count++) % QUEUE_LENGTH] = b;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&lock);
+}
+
+static struct batch *pop(void) {
+    pthread_mutex_lock(&lock);
+    while (count == 0) {
+        pthread_cond_wait(&not_empty, &lock);
+    }
+    struct batch *b = queue[head];
+    head = (head + 1) % QUEUE_LENGTH;
+    count--;
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&lock);
+    return b;
+}
+
+static void *produce(void *arg) {
+    uint64_t rng = (uintptr_t)arg + 1;
+    for (unsigned i = 0; i < BATCHES_PER_PRODUCER; i++) {
+        struct batch *b = malloc(sizeof(struct batch));
+        if (b == NULL) {
+            abort();
+        }
+        for (unsigned j = 0; j < BATCH; j++) {
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            size_t size = 16 + (rng >> 58) * 8;
+            b->objects[j] = malloc(size);
+            if (b->objects[j] == NULL) {
+                abort();
+            }
+            memset(b->objects[j], 0, 16);
+        }
+        push(b);
+    }
+    return NULL;
+}
+
+static void *consume(void *arg) {
+    (void)arg;
+    for (unsigned i = 0; i < BATCHES_PER_PRODUCER; i++) {
+        struct batch *b = pop();
+        for (unsigned j = 0; j < BATCH; j++) {
+            free(b->objects[j]);
+        }
+        free(b);
+    }
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[PAIRS * 2];
+    for (uintptr_t i = 0; i < PAIRS; i++) {
+        if (pthread_create(&threads[i * 2], NULL, produce, (void *)i) ||
+            pthread_create(&threads[i * 2 + 1], NULL, consume, NULL)) {
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < PAIRS * 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
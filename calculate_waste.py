@@ -24,6 +24,17 @@ size_class_slots = [
     6, 5, 4, 4
 ]
 
+size_class_slots_cold = [
+    256, 128, 85, 64, 51, 42, 36, 32,
+    25, 21, 18, 16,
+    12, 10, 9, 8,
+    6, 5, 4, 4,
+    3, 5, 2, 2,
+    3, 4, 1, 1,
+    3, 2, 4, 1,
+    2, 1, 2, 1
+]
+
 fragmentation = [100]
 
 for i in range(len(size_classes) - 1):
@@ -36,14 +47,16 @@ def page_align(size):
     return (size + 4095) & ~4095
 
 print("| ", end="")
-print("size class", "worst case internal fragmentation", "slab slots", "slab size", "worst case internal fragmentation for slabs", sep=" | ", end=" |\n")
+print("size class", "worst case internal fragmentation", "slab slots", "slab size", "worst case internal fragmentation for slabs", "cold slab slots", "cold slab size", "worst case internal fragmentation for cold slabs", sep=" | ", end=" |\n")
 print("| ", end='')
-print("-", "-", "-", "-", "-", sep=" | ", end=" |\n")
-for size, slots, fragmentation in zip(size_classes, size_class_slots, fragmentation):
+print("-", "-", "-", "-", "-", "-", "-", "-", sep=" | ", end=" |\n")
+for size, slots, cold_slots, fragmentation in zip(size_classes, size_class_slots, size_class_slots_cold, fragmentation):
     used = size * slots
     real = page_align(used)
+    cold_used = size * cold_slots
+    cold_real = page_align(cold_used)
     print("| ", end='')
-    print(size, str(fragmentation) + "%", slots, real, str(100 - used / real * 100) + "%", sep=" | ", end=" |\n")
+    print(size, str(fragmentation) + "%", slots, real, str(100 - used / real * 100) + "%", cold_slots, cold_real, str(100 - cold_used / cold_real * 100) + "%", sep=" | ", end=" |\n")
 
 if len(argv) < 2:
     exit()
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "cgroup.h"
+
+static const char cgroup_root[] = "/sys/fs/cgroup";
+
+static ssize_t read_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t len;
+    do {
+        len = read(fd, buf, size - 1);
+    } while (len == -1 && errno == EINTR);
+    close(fd);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+// build the path to a file in the cgroup v2 directory of the process
+int cgroup_path(char *path, size_t size, const char *file) {
+    char buf[PATH_MAX];
+    if (read_file("/proc/self/cgroup", buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+
+    // the unified hierarchy is the entry with hierarchy ID 0 and no controller list
+    char *line = buf;
+    while (strncmp(line, "0::", 3)) {
+        line = strchr(line, '\n');
+        if (line == NULL) {
+            return -1;
+        }
+        line++;
+    }
+    line += 3;
+    char *end = strchr(line, '\n');
+    if (end != NULL) {
+        *end = '\0';
+    }
+    if (!strcmp(line, "/")) {
+        line++;
+    }
+
+    size_t root_len = sizeof(cgroup_root) - 1;
+    size_t line_len = strlen(line);
+    size_t file_len = strlen(file);
+    if (root_len + line_len + 1 + file_len + 1 > size) {
+        return -1;
+    }
+    memcpy(path, cgroup_root, root_len);
+    memcpy(path + root_len, line, line_len);
+    path[root_len + line_len] = '/';
+    memcpy(path + root_len + line_len + 1, file, file_len + 1);
+    return 0;
+}
+
+// returns SIZE_MAX for "max" or a missing file
+static size_t read_limit(char *path, size_t dir_len, const char *file) {
+    char buf[32];
+    strcpy(path + dir_len, file);
+    if (read_file(path, buf, sizeof(buf)) <= 0 || !strncmp(buf, "max", 3)) {
+        return SIZE_MAX;
+    }
+    return strtoull(buf, NULL, 10);
+}
+
+// Find the memory that can still be used before hitting the memory.max or memory.high limit of
+// the cgroup of the process or any of the ancestors, which is where container limits are often
+// placed.
+int cgroup_memory_headroom(size_t *headroom) {
+    char path[PATH_MAX];
+    if (cgroup_path(path, sizeof(path) - sizeof("memory.current"), "")) {
+        return -1;
+    }
+
+    bool limited = false;
+    size_t min_headroom = SIZE_MAX;
+    size_t root_len = sizeof(cgroup_root) - 1;
+    size_t dir_len = strlen(path);
+    while (dir_len > root_len + 1) {
+        size_t max = read_limit(path, dir_len, "memory.max");
+        size_t high = read_limit(path, dir_len, "memory.high");
+        size_t limit = max < high ? max : high;
+        if (limit != SIZE_MAX) {
+            size_t current = read_limit(path, dir_len, "memory.current");
+            if (current == SIZE_MAX) {
+                current = 0;
+            }
+            size_t available = current < limit ? limit - current : 0;
+            if (available < min_headroom) {
+                min_headroom = available;
+            }
+            limited = true;
+        }
+
+        // move to the parent directory, keeping the trailing slash
+        dir_len--;
+        while (path[dir_len - 1] != '/') {
+            dir_len--;
+        }
+    }
+
+    if (!limited) {
+        return -1;
+    }
+    *headroom = min_headroom;
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stddef.h>
+
+int cgroup_path(char *path, size_t size, const char *file);
+int cgroup_memory_headroom(size_t *headroom);
+
+#endif
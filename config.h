@@ -9,4 +9,66 @@
 #define ZERO_ON_FREE true
 #define SLAB_CANARY true
 
+// delay reuse of freed slab slots, releasing them in randomized batches
+#ifndef SLAB_QUARANTINE
+#define SLAB_QUARANTINE true
+#endif
+// bytes of slots each size class holds in quarantine, up to SLAB_QUARANTINE_LENGTH slots
+#ifndef SLAB_QUARANTINE_SIZE
+#define SLAB_QUARANTINE_SIZE (64 * 1024)
+#endif
+
+#ifndef MEMORY_PRESSURE_MONITOR
+#define MEMORY_PRESSURE_MONITOR false
+#endif
+#ifndef CGROUP_CACHE_LIMIT
+#define CGROUP_CACHE_LIMIT false
+#endif
+#ifndef THREAD_FREE_BATCH
+#define THREAD_FREE_BATCH false
+#endif
+
+// minimum size of large allocations backed by 2MiB pages from the hugetlb pool, or 0 to disable
+#ifndef HUGETLB_THRESHOLD
+#define HUGETLB_THRESHOLD 0
+#endif
+
+// purge empty slabs with madvise through io_uring when available, delaying their reuse until done
+#ifndef ASYNC_PURGE
+#define ASYNC_PURGE false
+#endif
+
+// number of occupancy bins for the partial slabs, with 1 giving a single LIFO list
+#ifndef PARTIAL_SLAB_BINS
+#define PARTIAL_SLAB_BINS 4
+#endif
+
+// place slabs at power of 2 strides so finding the slab for a free is a shift
+#ifndef SLAB_POWER_OF_TWO_STRIDE
+#define SLAB_POWER_OF_TWO_STRIDE false
+#endif
+
+// count slow paths per thread for h_malloc_slow_paths
+#ifndef SLOW_PATH_TRACE
+#define SLOW_PATH_TRACE false
+#endif
+
+// count lock acquisitions and contention for h_malloc_lock_contention
+#ifndef LOCK_CONTENTION_TRACE
+#define LOCK_CONTENTION_TRACE false
+#endif
+
+// test-only: derive all random state from RANDOM_SEED for reproducible benchmarks
+#ifndef DETERMINISTIC_RANDOM
+#define DETERMINISTIC_RANDOM false
+#endif
+#ifndef RANDOM_SEED
+#define RANDOM_SEED 0
+#endif
+
+// address space reserved for each size class, also bounding the large allocation regions table
+#ifndef CLASS_REGION_SIZE
+#define CLASS_REGION_SIZE (128ULL * 1024 * 1024 * 1024)
+#endif
+
 #endif
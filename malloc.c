@@ -2,20 +2,29 @@
 #include <errno.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "third_party/libdivide.h"
 
+#include "cgroup.h"
 #include "config.h"
 #include "malloc.h"
 #include "mutex.h"
 #include "memory.h"
 #include "pages.h"
+#include "pressure.h"
 #include "random.h"
 #include "util.h"
 
@@ -34,17 +43,30 @@ static union {
         void *slab_region_end;
         struct region_info *regions[2];
         atomic_bool initialized;
+        pthread_key_t thread_key;
+        bool has_bmi2;
     };
     char padding[PAGE_SIZE];
 } ro __attribute__((aligned(PAGE_SIZE))) = {
     .initialized = ATOMIC_VAR_INIT(false)
 };
 
+#define MAX_SLAB_SLOTS 256
+#define BITMAP_LEAVES (MAX_SLAB_SLOTS / 64)
+
+// Slot bitmaps are split into 64-bit leaves with a summary of the leaves without free slots. The
+// metadata of each slab geometry only has the leaves covering its slots, followed by as many
+// quarantine leaves when the quarantine is enabled.
 struct slab_metadata {
-    uint64_t bitmap;
     struct slab_metadata *next;
     struct slab_metadata *prev;
     uint64_t canary_value;
+    uint8_t summary;
+    uint8_t geometry;
+    uint16_t used;
+    // index of the slab within the geometry
+    uint32_t index;
+    uint64_t bitmap[];
 };
 
 static const size_t min_align = 16;
@@ -74,8 +96,25 @@ static const uint16_t size_class_slots[] = {
     /* 2048 */ 6, 5, 4, 4
 };
 
+// slab slots for size classes with few slabs in use, keeping the slabs as small as possible
+// without much waste from page size rounding
+static const uint16_t size_class_slots_cold[] = {
+    /* 0 */ 256,
+    /* 16 */ 256, 128, 85, 64, 51, 42, 36, 32,
+    /* 32 */ 25, 21, 18, 16,
+    /* 64 */ 12, 10, 9, 8,
+    /* 128 */ 6, 5, 4, 4,
+    /* 256 */ 3, 5, 2, 2,
+    /* 512 */ 3, 4, 1, 1,
+    /* 1024 */ 3, 2, 4, 1,
+    /* 2048 */ 2, 1, 2, 1
+};
+
 #define N_SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
 
+// upper bound on quarantined slots for each size class, matching the bits in a random batch
+#define SLAB_QUARANTINE_LENGTH 64
+
 struct size_info {
     size_t size;
     size_t class;
@@ -115,147 +154,445 @@ static size_t get_slab_size(size_t slots, size_t size) {
 // limit on the number of cached empty slabs before attempting purging instead
 static const size_t max_empty_slabs_total = 64 * 1024;
 
+// fraction of the memory left before reaching the cgroup memory limit used for empty slab caching
+static const size_t cgroup_cache_divisor = 16;
+
+// limit on cached empty slabs for each size class, scaled down from the default in a cgroup with
+// little memory left before reaching the limit
+static atomic_size_t empty_slabs_limit;
+
+// set by the scavenger thread while the memory pressure monitor reports pressure
+static atomic_bool memory_pressure = ATOMIC_VAR_INIT(false);
+
+static size_t get_empty_slabs_limit(void) {
+    if (MEMORY_PRESSURE_MONITOR && atomic_load_explicit(&memory_pressure, memory_order_relaxed)) {
+        return 0;
+    }
+    return atomic_load_explicit(&empty_slabs_limit, memory_order_relaxed);
+}
+
+static void update_empty_slabs_limit(void) {
+    size_t limit = max_empty_slabs_total;
+    size_t headroom;
+    if (CGROUP_CACHE_LIMIT && !cgroup_memory_headroom(&headroom)) {
+        size_t scaled = headroom / cgroup_cache_divisor / N_SIZE_CLASSES;
+        if (scaled < limit) {
+            limit = scaled;
+        }
+    }
+    atomic_store_explicit(&empty_slabs_limit, limit, memory_order_relaxed);
+}
+
+// Each size class region is split between a cold slab geometry with small slabs, used while the
+// size class has few slabs in use, and a hot geometry with larger slabs to switch slabs less often
+// for size classes in heavy use.
+#define SLAB_GEOMETRIES 2
+#define GEOMETRY_COLD 0
+#define GEOMETRY_HOT 1
+
+// slabs in use before new slabs for a size class use the hot geometry
+static const size_t hot_slabs_threshold = 4;
+
+// Each geometry starts on its own cache line, holding the fields used by every allocation and free.
+struct slab_geometry {
+    // used by every allocation and free
+    void *region_start;
+    struct slab_metadata *slab_info;
+    // distance between slabs, with the rest of the stride left as a guard
+    size_t slab_stride;
+    size_t metadata_allocated;
+    struct libdivide_u64_t slab_stride_divisor;
+    uint32_t slots;
+    // 2^16 / slots, for binning partial slabs by occupancy without a division
+    uint32_t partial_bin_scale;
+    unsigned slab_stride_shift;
+    uint32_t metadata_size;
+
+    // only used when slabs are activated or purged
+    size_t slab_size;
+    size_t metadata_count;
+
+    // slabs without allocated slots that are purged and memory protected
+    //
+    // FIFO singly-linked list
+    struct slab_metadata *free_slabs_head;
+    struct slab_metadata *free_slabs_tail;
+
+    // slabs protected and queued for an asynchronous purge, moved to the free slabs once all of
+    // the submitted purges have completed
+    //
+    // LIFO singly-linked list
+    struct slab_metadata *pending_slabs;
+    size_t pending_submitted;
+    atomic_size_t pending_completed;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+static_assert(offsetof(struct slab_geometry, metadata_size) + sizeof(uint32_t) <= CACHELINE_SIZE,
+              "per-operation geometry fields must fit in a cache line");
+
+// Ordered so that allocations from partial slabs and frees only touch the first two cache lines and
+// the first line of one geometry, with the fields for slab activation, the quarantine and the
+// random state afterwards. The lock, class region start and size divisor used by every free share
+// the first line. The random state is used by every allocation, but every draw from it touches a
+// different part of the cache anyway.
 static struct size_class {
     struct mutex lock;
     void *class_region_start;
-    struct slab_metadata *slab_info;
+    struct libdivide_u32_t size_divisor;
 
-    // slabs with at least one allocated slot and at least one free slot
+    // slabs with at least one allocated slot and at least one free slot, binned by the fraction
+    // of free slots with the fullest slabs first
     //
-    // LIFO doubly-linked list
-    struct slab_metadata *partial_slabs;
+    // LIFO doubly-linked lists
+    struct slab_metadata *partial_slabs[PARTIAL_SLAB_BINS];
+
+    struct slab_geometry geometries[SLAB_GEOMETRIES];
 
     // slabs without allocated slots that are cached for near-term usage
     //
     // LIFO singly-linked list
     struct slab_metadata *empty_slabs;
-    size_t empty_slabs_total; // length * slab_size
+    size_t empty_slabs_total; // sum of slab sizes
 
-    // slabs without allocated slots that are purged and memory protected
-    //
-    // FIFO singly-linked list
-    struct slab_metadata *free_slabs_head;
-    struct slab_metadata *free_slabs_tail;
+    // slabs with at least one allocated slot
+    size_t used_slabs;
+
+    // slabs in each partial slab bin, for ranking slabs without walking the lists
+    size_t partial_counts[PARTIAL_SLAB_BINS];
+
+#if !GUARD_SLABS
+    // slabs made usable since a slab last became empty
+    size_t growth_streak;
+#endif
+
+    // slabs made readable and writable, excluding the zero byte size class
+    atomic_size_t committed; // sum of slab sizes
+
+    // freed slots with delayed reuse, oldest first
+    size_t quarantine_count;
+    size_t quarantine_capacity;
+    void *quarantine[SLAB_QUARANTINE_LENGTH];
 
-    struct libdivide_u32_t size_divisor;
-    struct libdivide_u64_t slab_size_divisor;
     struct random_state rng;
-    size_t metadata_allocated;
-    size_t metadata_count;
 } __attribute__((aligned(CACHELINE_SIZE))) size_class_metadata[N_SIZE_CLASSES];
 
-static const size_t class_region_size = 128ULL * 1024 * 1024 * 1024;
+// the lock counters of LOCK_CONTENTION_TRACE builds push the fields after it back
+#if !LOCK_CONTENTION_TRACE
+static_assert(offsetof(struct size_class, size_divisor) + sizeof(struct libdivide_u32_t) <= CACHELINE_SIZE,
+              "lock and free path fields must share the first cache line");
+static_assert(offsetof(struct size_class, partial_slabs) + PARTIAL_SLAB_BINS * sizeof(void *) <=
+              2 * CACHELINE_SIZE, "partial slab bins must be within the first two cache lines");
+#endif
+
+static_assert(!(CLASS_REGION_SIZE & (CLASS_REGION_SIZE - 1)), "class region size must be a power of 2");
+static_assert(CLASS_REGION_SIZE >= 1024 * 1024, "class region size too small for the largest slabs");
+
+static const size_t class_region_size = CLASS_REGION_SIZE;
 static const size_t real_class_region_size = class_region_size * 2;
+static const size_t geometry_region_size = class_region_size / SLAB_GEOMETRIES;
 static const size_t slab_region_size = real_class_region_size * N_SIZE_CLASSES;
 static_assert(PAGE_SIZE == 4096, "bitmap handling will need adjustment for other page sizes");
 
-static void *get_slab(struct size_class *c, size_t slab_size, struct slab_metadata *metadata) {
-    size_t index = metadata - c->slab_info;
-    return (char *)c->class_region_start + (index * slab_size);
+static_assert(CLASS_REGION_SIZE / SLAB_GEOMETRIES / PAGE_SIZE <= UINT32_MAX, "slab index too large");
+
+static size_t get_metadata_max(size_t slab_stride) {
+    return geometry_region_size / slab_stride;
 }
 
-static size_t get_metadata_max(size_t slab_size) {
-    return class_region_size / slab_size;
+static struct slab_metadata *get_slab_metadata(struct slab_geometry *g, size_t index) {
+    return (struct slab_metadata *)((char *)g->slab_info + index * g->metadata_size);
 }
 
-static struct slab_metadata *alloc_metadata(struct size_class *c, size_t slab_size, bool non_zero_size) {
-    if (unlikely(c->metadata_count >= c->metadata_allocated)) {
-        size_t metadata_max = get_metadata_max(slab_size);
-        if (c->metadata_count >= metadata_max) {
-            errno = ENOMEM;
+static struct slab_geometry *get_geometry(struct size_class *c, struct slab_metadata *metadata) {
+    return &c->geometries[metadata->geometry];
+}
+
+static bool is_exhausted(struct slab_geometry *g) {
+    return g->free_slabs_head == NULL && g->pending_slabs == NULL &&
+        g->metadata_count >= get_metadata_max(g->slab_stride);
+}
+
+static struct slab_geometry *choose_geometry(struct size_class *c) {
+    unsigned geometry = c->used_slabs >= hot_slabs_threshold ? GEOMETRY_HOT : GEOMETRY_COLD;
+    if (is_exhausted(&c->geometries[geometry])) {
+        geometry = !geometry;
+    }
+    return &c->geometries[geometry];
+}
+
+static void *get_slab(struct slab_geometry *g, struct slab_metadata *metadata) {
+    return (char *)g->region_start + ((size_t)metadata->index * g->slab_stride);
+}
+
+static const uint64_t canary_mask = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ?
+    0xffffffffffffff00UL :
+    0x00ffffffffffffffUL;
+
+// Slabs are only adjacent without guard slabs or stride guards, and the zero byte size class
+// doesn't make its slabs accessible, so readahead is limited to the other cases. It's compiled out
+// with guard slabs, since making the guards usable along with a run would defeat them.
+#if GUARD_SLABS
+static size_t get_slab_readahead(UNUSED struct size_class *c, UNUSED struct slab_geometry *g,
+                                 UNUSED bool non_zero_size) {
+    return 1;
+}
+#else
+// limit on the slabs made usable at once for a size class that keeps growing
+static const size_t max_slab_readahead = 16;
+
+static size_t get_slab_readahead(struct size_class *c, struct slab_geometry *g, bool non_zero_size) {
+    c->growth_streak++;
+    if (g->slab_stride != g->slab_size || !non_zero_size) {
+        return 1;
+    }
+
+    size_t count = c->growth_streak < max_slab_readahead ? c->growth_streak : max_slab_readahead;
+
+    // the extra slabs go into the empty slab cache
+    size_t limit = get_empty_slabs_limit();
+    size_t room = c->empty_slabs_total < limit ? (limit - c->empty_slabs_total) / g->slab_size : 0;
+    if (count > room + 1) {
+        count = room + 1;
+    }
+
+    // readahead doesn't grow the metadata array
+    size_t available = g->metadata_allocated - g->metadata_count;
+    if (count > available) {
+        count = available;
+    }
+    return count ? count : 1;
+}
+#endif
+
+// Make a new slab usable, along with count - 1 adjacent slabs placed in the empty slab cache using
+// the same system call.
+static struct slab_metadata *alloc_metadata(struct size_class *c, struct slab_geometry *g, bool non_zero_size,
+                                            size_t count) {
+    if (unlikely(g->metadata_count >= g->metadata_allocated)) {
+        size_t metadata_max = get_metadata_max(g->slab_stride);
+        if (g->metadata_count >= metadata_max) {
+            errno = ENOSPC;
             return NULL;
         }
-        size_t allocate = c->metadata_allocated * 2;
+        size_t allocate = g->metadata_allocated * 2;
         if (allocate > metadata_max) {
             allocate = metadata_max;
         }
-        if (memory_protect_rw(c->slab_info, allocate * sizeof(struct slab_metadata))) {
+        if (memory_protect_rw(g->slab_info, allocate * g->metadata_size)) {
             return NULL;
         }
-        c->metadata_allocated = allocate;
+        g->metadata_allocated = allocate;
     }
 
-    struct slab_metadata *metadata = c->slab_info + c->metadata_count;
-    void *slab = get_slab(c, slab_size, metadata);
-    if (non_zero_size && memory_protect_rw(slab, slab_size)) {
-        return NULL;
+    trace_slow_path(SLOW_PATH_METADATA);
+
+    size_t index = g->metadata_count;
+    struct slab_metadata *metadata = get_slab_metadata(g, index);
+    metadata->index = index;
+    void *slab = get_slab(g, metadata);
+    if (non_zero_size) {
+        if (memory_protect_rw(slab, g->slab_size * count)) {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&c->committed, g->slab_size * count, memory_order_relaxed);
     }
-    c->metadata_count++;
+    metadata->geometry = g - c->geometries;
+    g->metadata_count++;
     if (GUARD_SLABS) {
-        c->metadata_count++;
+        g->metadata_count++;
     }
+
+    // pushed in reverse so the lowest addresses are reused first
+    for (size_t i = count - 1; i > 0; i--) {
+        struct slab_metadata *extra = get_slab_metadata(g, index + i);
+        extra->index = index + i;
+        extra->geometry = metadata->geometry;
+        extra->canary_value = get_random_u64(&c->rng) & canary_mask;
+        extra->next = c->empty_slabs;
+        c->empty_slabs = extra;
+        c->empty_slabs_total += g->slab_size;
+    }
+    g->metadata_count += count - 1;
+
     return metadata;
 }
 
 static void check_index(size_t index) {
-    if (index >= 64) {
+    if (index >= MAX_SLAB_SLOTS) {
         fatal_error("invalid index");
     }
 }
 
-static void set_slot(struct slab_metadata *metadata, size_t index) {
+static size_t get_leaves(size_t slots) {
+    return (slots + 63) / 64;
+}
+
+// bits in a leaf of the bitmap beyond the end of the slots
+static uint64_t get_mask(size_t slots, size_t leaf) {
+    size_t end = slots - leaf * 64;
+    return end < 64 ? ~0UL << end : 0;
+}
+
+static size_t get_metadata_size(size_t slots) {
+    return sizeof(struct slab_metadata) + get_leaves(slots) * sizeof(uint64_t) * (SLAB_QUARANTINE ? 2 : 1);
+}
+
+static uint64_t *get_quarantine(size_t slots, struct slab_metadata *metadata) {
+    return metadata->bitmap + get_leaves(slots);
+}
+
+// allocated slots in a leaf, excluding the quarantined ones
+static uint64_t get_live_slots(size_t slots, struct slab_metadata *metadata, size_t leaf) {
+    uint64_t live = metadata->bitmap[leaf] & ~get_mask(slots, leaf);
+    if (SLAB_QUARANTINE) {
+        live &= ~get_quarantine(slots, metadata)[leaf];
+    }
+    return live;
+}
+
+static void set_slot(size_t slots, struct slab_metadata *metadata, size_t index) {
     check_index(index);
-    metadata->bitmap |= 1UL << index;
+    size_t leaf = index / 64;
+    metadata->bitmap[leaf] |= 1UL << (index % 64);
+    metadata->used++;
+    if ((metadata->bitmap[leaf] | get_mask(slots, leaf)) == ~0UL) {
+        metadata->summary |= 1U << leaf;
+    }
 }
 
 static void clear_slot(struct slab_metadata *metadata, size_t index) {
     check_index(index);
-    metadata->bitmap &= ~(1UL << index);
+    size_t leaf = index / 64;
+    metadata->bitmap[leaf] &= ~(1UL << (index % 64));
+    metadata->used--;
+    metadata->summary &= ~(1U << leaf);
 }
 
 static bool get_slot(struct slab_metadata *metadata, size_t index) {
     check_index(index);
-    return (metadata->bitmap >> index) & 1UL;
+    return (metadata->bitmap[index / 64] >> (index % 64)) & 1UL;
 }
 
-static uint64_t get_mask(size_t slots) {
-    return slots < 64 ? ~0UL << slots : 0;
+// Slabs are page aligned, so with a size class that's not a multiple of an alignment every
+// alignment / (lowest set bit of size) slot is aligned. These are the patterns of aligned slots
+// within a leaf indexed by the log2 of the step between them.
+static const uint64_t aligned_slot_patterns[] = {
+    0xffffffffffffffff, 0x5555555555555555, 0x1111111111111111, 0x0101010101010101,
+    0x0001000100010001, 0x0000000100000001, 0x0000000000000001
+};
+
+#define ALL_SLOTS aligned_slot_patterns[0]
+
+// pattern limits the search to the matching slots in each leaf
+struct free_slots {
+    uint64_t bits[BITMAP_LEAVES];
+    size_t count[BITMAP_LEAVES];
+};
+
+// Find the free slots in each leaf, returning the total.
+static size_t get_free_slots(size_t slots, struct slab_metadata *metadata, uint64_t pattern,
+                             struct free_slots *available) {
+    size_t total = 0;
+    for (size_t leaf = 0; leaf < get_leaves(slots); leaf++) {
+        available->bits[leaf] = ~(metadata->bitmap[leaf] | get_mask(slots, leaf) | ~pattern);
+        available->count[leaf] = __builtin_popcountl(available->bits[leaf]);
+        total += available->count[leaf];
+    }
+    return total;
 }
 
-static size_t get_free_slot(struct random_state *rng, size_t slots, struct slab_metadata *metadata) {
-    if (slots > 64) {
-        slots = 64;
+static size_t select_free_slot(const struct free_slots *available, size_t n) {
+    size_t leaf = 0;
+    while (n >= available->count[leaf]) {
+        n -= available->count[leaf++];
+    }
+    uint64_t bits = available->bits[leaf];
+    for (; n; n--) {
+        bits &= bits - 1;
     }
+    return leaf * 64 + __builtin_ctzl(bits);
+}
+
+#ifdef __x86_64__
+// Same as the portable versions, with hardware popcount and the n-th set bit of a leaf found by
+// depositing a single bit at its position.
+__attribute__((target("bmi2,popcnt")))
+static size_t get_free_slots_bmi2(size_t slots, struct slab_metadata *metadata, uint64_t pattern,
+                                  struct free_slots *available) {
+    return get_free_slots(slots, metadata, pattern, available);
+}
 
-    uint64_t masked = metadata->bitmap | get_mask(slots);
-    if (masked == ~0UL) {
-        fatal_error("no zero bits");
+__attribute__((target("bmi2,popcnt")))
+static size_t select_free_slot_bmi2(const struct free_slots *available, size_t n) {
+    size_t leaf = 0;
+    while (n >= available->count[leaf]) {
+        n -= available->count[leaf++];
     }
+    return leaf * 64 + __builtin_ctzl(_pdep_u64(1UL << n, available->bits[leaf]));
+}
+#endif
 
+static size_t get_free_slot(struct random_state *rng, size_t slots, struct slab_metadata *metadata,
+                            uint64_t pattern) {
     if (SLOT_RANDOMIZE) {
-        // randomize start location for linear search (uniform random choice is too slow)
-        uint64_t random_split = ~(~0UL << get_random_u16_uniform(rng, slots));
+        // uniform random choice among the free slots
+        struct free_slots available;
+#ifdef __x86_64__
+        if (ro.has_bmi2) {
+            size_t total = get_free_slots_bmi2(slots, metadata, pattern, &available);
+            if (unlikely(total == 0)) {
+                fatal_error("no zero bits");
+            }
+            return select_free_slot_bmi2(&available, get_random_u16_uniform(rng, total));
+        }
+#endif
+        size_t total = get_free_slots(slots, metadata, pattern, &available);
+        if (unlikely(total == 0)) {
+            fatal_error("no zero bits");
+        }
+        return select_free_slot(&available, get_random_u16_uniform(rng, total));
+    }
 
-        size_t slot = ffzl(masked | random_split);
-        if (slot) {
-            return slot - 1;
+    for (size_t leaf = 0; leaf < get_leaves(slots); leaf++) {
+        if (!((metadata->summary >> leaf) & 1)) {
+            uint64_t masked = metadata->bitmap[leaf] | get_mask(slots, leaf) | ~pattern;
+            if (masked != ~0UL) {
+                return leaf * 64 + ffzl(masked) - 1;
+            }
         }
     }
 
-    return ffzl(masked) - 1;
+    fatal_error("no zero bits");
 }
 
 static bool has_free_slots(size_t slots, struct slab_metadata *metadata) {
-    if (slots > 64) {
-        slots = 64;
-    }
-
-    uint64_t masked = metadata->bitmap | get_mask(slots);
-    return masked != ~0UL;
+    return metadata->summary != (1U << get_leaves(slots)) - 1;
 }
 
-static bool is_free_slab(struct slab_metadata *metadata) {
-    return !metadata->bitmap;
+static bool has_free_aligned_slots(size_t slots, struct slab_metadata *metadata, uint64_t pattern) {
+    for (size_t leaf = 0; leaf < get_leaves(slots); leaf++) {
+        if ((metadata->bitmap[leaf] | get_mask(slots, leaf) | ~pattern) != ~0UL) {
+            return true;
+        }
+    }
+    return false;
 }
 
 static struct slab_metadata *get_metadata(struct size_class *c, void *p) {
     size_t offset = (char *)p - (char *)c->class_region_start;
-    size_t index = libdivide_u64_do(offset, &c->slab_size_divisor);
-    // still caught without this check either as a read access violation or "double free"
-    if (index >= c->metadata_allocated) {
+    size_t geometry = offset / geometry_region_size;
+    // still caught without these checks either as a read access violation or "double free"
+    if (geometry >= SLAB_GEOMETRIES) {
+        fatal_error("invalid free within a slab yet to be used");
+    }
+    struct slab_geometry *g = &c->geometries[geometry];
+    offset -= geometry * geometry_region_size;
+    size_t index = SLAB_POWER_OF_TWO_STRIDE ? offset >> g->slab_stride_shift :
+        libdivide_u64_do(offset, &g->slab_stride_divisor);
+    if (index >= g->metadata_allocated) {
         fatal_error("invalid free within a slab yet to be used");
     }
-    return c->slab_info + index;
+    return get_slab_metadata(g, index);
 }
 
 static void *slot_pointer(size_t size, void *slab, size_t slot) {
@@ -274,108 +611,513 @@ static void write_after_free_check(char *p, size_t size) {
     }
 }
 
-static const uint64_t canary_mask = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ?
-    0xffffffffffffff00UL :
-    0x00ffffffffffffffUL;
-
 static void set_canary(struct slab_metadata *metadata, void *p, size_t size) {
     memcpy((char *)p + size - canary_size, &metadata->canary_value, canary_size);
 }
 
-static inline void *allocate_small(size_t requested_size) {
-    struct size_info info = get_size_info(requested_size);
-    size_t size = info.size ? info.size : 16;
-    struct size_class *c = &size_class_metadata[info.class];
-    size_t slots = size_class_slots[info.class];
-    size_t slab_size = get_slab_size(slots, size);
+static_assert(PARTIAL_SLAB_BINS >= 1 && PARTIAL_SLAB_BINS <= 16, "invalid partial slab bin count");
 
-    mutex_lock(&c->lock);
+static size_t get_partial_bin(struct slab_geometry *g, struct slab_metadata *metadata) {
+    if (PARTIAL_SLAB_BINS == 1) {
+        return 0;
+    }
+    return (((g->slots - metadata->used) * PARTIAL_SLAB_BINS - 1) * g->partial_bin_scale) >> 16;
+}
 
-    if (c->partial_slabs == NULL) {
-        if (c->empty_slabs != NULL) {
-            struct slab_metadata *metadata = c->empty_slabs;
-            c->empty_slabs = c->empty_slabs->next;
-            c->empty_slabs_total -= slab_size;
+// Allocating from the fullest slabs lets the emptier ones drain so that they can be cached or
+// purged.
+static struct slab_metadata *get_partial_slab(struct size_class *c) {
+    for (size_t bin = 0; bin < PARTIAL_SLAB_BINS; bin++) {
+        if (c->partial_slabs[bin] != NULL) {
+            return c->partial_slabs[bin];
+        }
+    }
+    return NULL;
+}
 
-            metadata->next = NULL;
-            metadata->prev = NULL;
+static void push_partial_slab(struct size_class *c, size_t bin, struct slab_metadata *metadata) {
+    c->partial_counts[bin]++;
+    metadata->next = c->partial_slabs[bin];
+    metadata->prev = NULL;
 
-            c->partial_slabs = metadata;
+    if (c->partial_slabs[bin]) {
+        c->partial_slabs[bin]->prev = metadata;
+    }
+    c->partial_slabs[bin] = metadata;
+}
 
-            void *slab = get_slab(c, slab_size, metadata);
-            size_t slot = get_free_slot(&c->rng, slots, metadata);
-            set_slot(metadata, slot);
-            void *p = slot_pointer(size, slab, slot);
-            if (requested_size) {
-                write_after_free_check(p, size - canary_size);
-                set_canary(metadata, p, size);
-            }
+static void remove_partial_slab(struct size_class *c, size_t bin, struct slab_metadata *metadata) {
+    c->partial_counts[bin]--;
+    if (metadata->prev) {
+        metadata->prev->next = metadata->next;
+    } else {
+        c->partial_slabs[bin] = metadata->next;
+    }
+    if (metadata->next) {
+        metadata->next->prev = metadata->prev;
+    }
 
-            mutex_unlock(&c->lock);
-            return p;
-        } else if (c->free_slabs_head != NULL) {
-            struct slab_metadata *metadata = c->free_slabs_head;
-            metadata->canary_value = get_random_u64(&c->rng);
+    metadata->next = NULL;
+    metadata->prev = NULL;
+}
 
-            void *slab = get_slab(c, slab_size, metadata);
-            if (requested_size && memory_protect_rw(slab, slab_size)) {
-                mutex_unlock(&c->lock);
-                return NULL;
+static void enqueue_free_slab(struct slab_geometry *g, struct slab_metadata *metadata) {
+    metadata->next = NULL;
+
+    if (g->free_slabs_tail != NULL) {
+        g->free_slabs_tail->next = metadata;
+    } else {
+        g->free_slabs_head = metadata;
+    }
+    g->free_slabs_tail = metadata;
+}
+
+// Purge and protect an empty slab, returning whether it failed. An asynchronous purge leaves the
+// slab pending until it completes.
+static bool purge_slab(struct slab_geometry *g, struct slab_metadata *metadata) {
+    void *slab = get_slab(g, metadata);
+    if (ASYNC_PURGE && memory_purge_async(slab, g->slab_size, &g->pending_completed)) {
+        g->pending_submitted++;
+        metadata->next = g->pending_slabs;
+        g->pending_slabs = metadata;
+        return false;
+    }
+    if (memory_map_fixed(slab, g->slab_size)) {
+        return true;
+    }
+    enqueue_free_slab(g, metadata);
+    return false;
+}
+
+// Move the pending slabs to the free slabs if their purges are done, waiting for them if requested.
+// Only completion of the whole batch is tracked since the purges can complete out of order.
+static void collect_pending_slabs(struct slab_geometry *g, bool wait) {
+    memory_purge_async_reap(false);
+    while (atomic_load_explicit(&g->pending_completed, memory_order_acquire) != g->pending_submitted) {
+        if (!wait) {
+            return;
+        }
+        memory_purge_async_reap(true);
+    }
+
+    struct slab_metadata *metadata = g->pending_slabs;
+    while (metadata != NULL) {
+        struct slab_metadata *next = metadata->next;
+        enqueue_free_slab(g, metadata);
+        metadata = next;
+    }
+    g->pending_slabs = NULL;
+}
+
+// return a slot to its slab, moving the slab between the lists as needed
+static void release_slot(struct size_class *c, struct slab_metadata *metadata, size_t slot, bool is_zero_size) {
+    struct slab_geometry *g = get_geometry(c, metadata);
+
+    bool was_full = !has_free_slots(g->slots, metadata);
+    size_t bin = was_full ? 0 : get_partial_bin(g, metadata);
+
+    clear_slot(metadata, slot);
+
+    if (metadata->used != 0) {
+        size_t new_bin = get_partial_bin(g, metadata);
+        if (was_full) {
+            push_partial_slab(c, new_bin, metadata);
+        } else if (new_bin != bin) {
+            remove_partial_slab(c, bin, metadata);
+            push_partial_slab(c, new_bin, metadata);
+        }
+        return;
+    }
+
+    if (!was_full) {
+        remove_partial_slab(c, bin, metadata);
+    }
+    c->used_slabs--;
+#if !GUARD_SLABS
+    c->growth_streak = 0;
+#endif
+
+    if (c->empty_slabs_total + g->slab_size > get_empty_slabs_limit()) {
+        trace_slow_path(SLOW_PATH_PURGE);
+        if (!purge_slab(g, metadata)) {
+            if (!is_zero_size) {
+                atomic_fetch_sub_explicit(&c->committed, g->slab_size, memory_order_relaxed);
             }
+            return;
+        }
+        // handle out-of-memory by just putting it into the empty slabs list
+    }
+
+    metadata->next = c->empty_slabs;
+    c->empty_slabs = metadata;
+    c->empty_slabs_total += g->slab_size;
+}
 
-            c->free_slabs_head = c->free_slabs_head->next;
-            if (c->free_slabs_head == NULL) {
-                c->free_slabs_tail = NULL;
+static void release_quarantined(struct size_class *c, size_t size, void *p, bool is_zero_size) {
+    struct slab_metadata *metadata = get_metadata(c, p);
+    struct slab_geometry *g = get_geometry(c, metadata);
+    void *slab = get_slab(g, metadata);
+    size_t slot = libdivide_u32_do((char *)p - (char *)slab, &c->size_divisor);
+    get_quarantine(g->slots, metadata)[slot / 64] &= ~(1UL << (slot % 64));
+
+    // the slot was zeroed when it entered the quarantine
+    if (!is_zero_size) {
+        write_after_free_check(p, size - canary_size);
+    }
+
+    release_slot(c, metadata, slot, is_zero_size);
+}
+
+// Release a random batch of the quarantined slots with a single random draw. The oldest slot is
+// always part of the batch, so slots are released after at most one batch per slot in the queue.
+static void release_quarantine_batch(struct size_class *c, size_t size, bool is_zero_size) {
+    trace_slow_path(SLOW_PATH_QUARANTINE_BATCH);
+    uint64_t batch = get_random_u64(&c->rng) | 1;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < c->quarantine_count; i++) {
+        void *p = c->quarantine[i];
+        if ((batch >> i) & 1) {
+            release_quarantined(c, size, p, is_zero_size);
+        } else {
+            c->quarantine[kept++] = p;
+        }
+    }
+    c->quarantine_count = kept;
+}
+
+static void flush_quarantine(struct size_class *c, size_t class) {
+    size_t size = size_classes[class];
+    bool is_zero_size = size == 0;
+    if (is_zero_size) {
+        size = 16;
+    }
+
+    for (size_t i = 0; i < c->quarantine_count; i++) {
+        release_quarantined(c, size, c->quarantine[i], is_zero_size);
+    }
+    c->quarantine_count = 0;
+}
+
+// Purge and protect cached empty slabs until each size class is within the limit, returning
+// whether any were purged. The quarantines are only flushed by an explicit trim, since flushing
+// them for out-of-memory retries or budget purges would let a failed allocation skip delayed reuse.
+static bool purge_empty_slabs(size_t limit, bool flush) {
+    bool is_trimmed = false;
+
+    // skip zero byte size class since there's nothing to change
+    for (unsigned class = 1; class < N_SIZE_CLASSES; class++) {
+        struct size_class *c = &size_class_metadata[class];
+
+        mutex_lock(&c->lock);
+        if (flush) {
+            flush_quarantine(c, class);
+        }
+        struct slab_metadata *iterator = c->empty_slabs;
+        while (iterator && c->empty_slabs_total > limit) {
+            struct slab_geometry *g = get_geometry(c, iterator);
+            trace_slow_path(SLOW_PATH_PURGE);
+            struct slab_metadata *next = iterator->next;
+            if (purge_slab(g, iterator)) {
+                break;
             }
 
-            metadata->next = NULL;
-            metadata->prev = NULL;
+            iterator = next;
+            c->empty_slabs_total -= g->slab_size;
+            atomic_fetch_sub_explicit(&c->committed, g->slab_size, memory_order_relaxed);
+
+            is_trimmed = true;
+        }
+        c->empty_slabs = iterator;
+        mutex_unlock(&c->lock);
+    }
+
+    return is_trimmed;
+}
+
+// interval for the periodic work done by the scavenger thread
+static const int scavenger_interval = 1000;
 
-            c->partial_slabs = metadata;
+// time without a new pressure event before caches are restored
+static const time_t pressure_relief_timeout = 10;
 
-            size_t slot = get_free_slot(&c->rng, slots, metadata);
-            set_slot(metadata, slot);
-            void *p = slot_pointer(size, slab, slot);
-            if (requested_size) {
-                set_canary(metadata, p, size);
+// Waits for memory pressure events and purges cached memory when they arrive, with caching disabled
+// until no event has been reported for the relief timeout. The empty slab cache limit derived from
+// the cgroup memory limit is refreshed periodically. The thread doesn't survive fork, so a forked
+// child starts its own through restart_scavenger.
+static void *scavenger(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    struct timespec last_event = {0};
+
+    for (;;) {
+        int ret = 0;
+        if (fd != -1) {
+            ret = pressure_wait(fd, scavenger_interval);
+            if (ret == -1) {
+                close(fd);
+                fd = -1;
+                atomic_store_explicit(&memory_pressure, false, memory_order_relaxed);
+                if (!CGROUP_CACHE_LIMIT) {
+                    return NULL;
+                }
+                continue;
             }
+        } else {
+            struct timespec interval = {scavenger_interval / 1000, 0};
+            nanosleep(&interval, NULL);
+        }
 
-            mutex_unlock(&c->lock);
-            return p;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (ret) {
+            last_event = now;
+            atomic_store_explicit(&memory_pressure, true, memory_order_relaxed);
+            purge_empty_slabs(0, false);
+        } else if (now.tv_sec - last_event.tv_sec >= pressure_relief_timeout) {
+            atomic_store_explicit(&memory_pressure, false, memory_order_relaxed);
         }
 
-        struct slab_metadata *metadata = alloc_metadata(c, slab_size, requested_size);
-        if (unlikely(metadata == NULL)) {
-            mutex_unlock(&c->lock);
-            return NULL;
+        if (CGROUP_CACHE_LIMIT) {
+            update_empty_slabs_limit();
+            purge_empty_slabs(get_empty_slabs_limit(), false);
         }
+    }
+}
+
+COLD static void start_scavenger(void) {
+    int fd = -1;
+    if (MEMORY_PRESSURE_MONITOR) {
+        fd = pressure_open();
+        if (fd == -1 && !CGROUP_CACHE_LIMIT) {
+            return;
+        }
+    }
+
+    // leave signal handling to the threads created by the application
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, scavenger, (void *)(intptr_t)fd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret) {
+        close(fd);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// set in a forked child until its scavenger thread is started
+static atomic_bool scavenger_restart;
+
+// Creating a thread isn't safe in the fork handler, so the child starts its scavenger lazily the
+// next time it commits memory.
+COLD static void restart_scavenger(void) {
+    if (atomic_exchange_explicit(&scavenger_restart, false, memory_order_relaxed)) {
+        start_scavenger();
+    }
+}
+
+// larger requests can't fit in the user address space, so purging won't help them
+static const size_t max_mappable_size = (size_t)1 << 47;
+
+// large allocations, tracked as page-rounded sizes
+static atomic_size_t regions_committed;
+
+struct budget_settings {
+    size_t budget;
+    void (*callback)(size_t committed, void *arg);
+    void *arg;
+};
+
+// published by h_malloc_set_budget, or NULL without a budget or callback
+static _Atomic(const struct budget_settings *) budget_settings;
+
+// set once the budget threshold has been reached until usage is found to be below it again
+static atomic_bool budget_triggered;
+
+// memory committed for allocations, aggregated lazily from the per-class counters
+static size_t get_committed(void) {
+    size_t total = atomic_load_explicit(&regions_committed, memory_order_relaxed);
+    for (unsigned class = 1; class < N_SIZE_CLASSES; class++) {
+        total += atomic_load_explicit(&size_class_metadata[class].committed, memory_order_relaxed);
+    }
+    return total;
+}
+
+static void notify_budget(const struct budget_settings *settings, size_t committed) {
+    if (settings->callback != NULL) {
+        settings->callback(committed, settings->arg);
+    }
+}
+
+// Called without locks held when committing more memory. Crossing 7/8 of the budget purges the
+// cached empty slabs and notifies the callback, once per crossing.
+static void check_budget(size_t size) {
+    if ((MEMORY_PRESSURE_MONITOR || CGROUP_CACHE_LIMIT) &&
+            unlikely(atomic_load_explicit(&scavenger_restart, memory_order_relaxed))) {
+        restart_scavenger();
+    }
+
+    const struct budget_settings *settings = atomic_load_explicit(&budget_settings, memory_order_acquire);
+    if (likely(settings == NULL) || !settings->budget || size > max_mappable_size) {
+        return;
+    }
+
+    size_t budget = settings->budget;
+    size_t committed = get_committed();
+    if (committed + size < budget - budget / 8) {
+        atomic_store_explicit(&budget_triggered, false, memory_order_relaxed);
+        return;
+    }
+    if (atomic_exchange_explicit(&budget_triggered, true, memory_order_relaxed)) {
+        return;
+    }
+
+    purge_empty_slabs(0, false);
+    notify_budget(settings, get_committed());
+}
+
+// Called without locks held after an allocation failed, returning whether it's worth retrying
+// after giving cached memory back to the OS. Only failures to map or commit memory are retried,
+// with running out of slab metadata or region table entries failing with ENOSPC internally. The
+// failure is reported as ENOMEM either way.
+COLD static bool handle_out_of_memory(size_t size) {
+    bool retry = errno == ENOMEM && size <= max_mappable_size;
+    errno = ENOMEM;
+    if (!retry) {
+        return false;
+    }
+    bool purged = purge_empty_slabs(0, false);
+    const struct budget_settings *settings = atomic_load_explicit(&budget_settings, memory_order_acquire);
+    if (settings != NULL) {
+        notify_budget(settings, get_committed());
+    }
+    return purged;
+}
+
+// activate a slab for a size class without partial slabs, releasing the size class lock
+static inline void *allocate_from_new_slab(struct size_class *c, size_t size, size_t requested_size,
+                                           uint64_t pattern) {
+    if (c->empty_slabs != NULL) {
+        struct slab_metadata *metadata = c->empty_slabs;
+        struct slab_geometry *g = get_geometry(c, metadata);
+        c->empty_slabs = c->empty_slabs->next;
+        c->empty_slabs_total -= g->slab_size;
+
+        metadata->next = NULL;
+        metadata->prev = NULL;
+        c->used_slabs++;
+
+        void *slab = get_slab(g, metadata);
+        size_t slot = get_free_slot(&c->rng, g->slots, metadata, pattern);
+        set_slot(g->slots, metadata, slot);
+        if (has_free_slots(g->slots, metadata)) {
+            push_partial_slab(c, get_partial_bin(g, metadata), metadata);
+        }
+        void *p = slot_pointer(size, slab, slot);
+        if (requested_size) {
+            write_after_free_check(p, size - canary_size);
+            set_canary(metadata, p, size);
+        }
+
+        mutex_unlock(&c->lock);
+        return p;
+    }
+
+    struct slab_geometry *g = choose_geometry(c);
+
+    // new slabs are used while purges are in flight unless the geometry has run out of them
+    if (g->free_slabs_head == NULL && g->pending_slabs != NULL) {
+        collect_pending_slabs(g, g->metadata_count >= get_metadata_max(g->slab_stride));
+    }
+
+    if (g->free_slabs_head != NULL) {
+        struct slab_metadata *metadata = g->free_slabs_head;
         metadata->canary_value = get_random_u64(&c->rng) & canary_mask;
+        trace_slow_path(SLOW_PATH_REACTIVATE);
 
-        c->partial_slabs = metadata;
-        void *slab = get_slab(c, slab_size, metadata);
-        size_t slot = get_free_slot(&c->rng, slots, metadata);
-        set_slot(metadata, slot);
+        void *slab = get_slab(g, metadata);
+        if (requested_size) {
+            if (memory_protect_rw(slab, g->slab_size)) {
+                mutex_unlock(&c->lock);
+                return NULL;
+            }
+            atomic_fetch_add_explicit(&c->committed, g->slab_size, memory_order_relaxed);
+        }
+
+        g->free_slabs_head = g->free_slabs_head->next;
+        if (g->free_slabs_head == NULL) {
+            g->free_slabs_tail = NULL;
+        }
+
+        metadata->next = NULL;
+        metadata->prev = NULL;
+        c->used_slabs++;
+
+        size_t slot = get_free_slot(&c->rng, g->slots, metadata, pattern);
+        set_slot(g->slots, metadata, slot);
+        if (has_free_slots(g->slots, metadata)) {
+            push_partial_slab(c, get_partial_bin(g, metadata), metadata);
+        }
         void *p = slot_pointer(size, slab, slot);
         if (requested_size) {
             set_canary(metadata, p, size);
         }
 
         mutex_unlock(&c->lock);
+        check_budget(0);
         return p;
     }
 
-    struct slab_metadata *metadata = c->partial_slabs;
-    size_t slot = get_free_slot(&c->rng, slots, metadata);
-    set_slot(metadata, slot);
+    struct slab_metadata *metadata = alloc_metadata(c, g, requested_size,
+                                                    get_slab_readahead(c, g, requested_size));
+    if (unlikely(metadata == NULL)) {
+        mutex_unlock(&c->lock);
+        return NULL;
+    }
+    metadata->canary_value = get_random_u64(&c->rng) & canary_mask;
+
+    c->used_slabs++;
 
-    if (!has_free_slots(slots, metadata)) {
-        c->partial_slabs = c->partial_slabs->next;
-        if (c->partial_slabs) {
-            c->partial_slabs->prev = NULL;
+    void *slab = get_slab(g, metadata);
+    size_t slot = get_free_slot(&c->rng, g->slots, metadata, pattern);
+    set_slot(g->slots, metadata, slot);
+    if (has_free_slots(g->slots, metadata)) {
+        push_partial_slab(c, get_partial_bin(g, metadata), metadata);
+    }
+    void *p = slot_pointer(size, slab, slot);
+    if (requested_size) {
+        set_canary(metadata, p, size);
+    }
+
+    mutex_unlock(&c->lock);
+    check_budget(0);
+    return p;
+}
+
+// allocate from the fullest partial slab, releasing the size class lock
+static inline void *allocate_from_partial_slab(struct size_class *c, size_t size, size_t requested_size,
+                                               uint64_t pattern) {
+    struct slab_metadata *metadata = get_partial_slab(c);
+    struct slab_geometry *g = get_geometry(c, metadata);
+    size_t bin = get_partial_bin(g, metadata);
+    size_t slot = get_free_slot(&c->rng, g->slots, metadata, pattern);
+    set_slot(g->slots, metadata, slot);
+
+    if (!has_free_slots(g->slots, metadata)) {
+        remove_partial_slab(c, bin, metadata);
+    } else {
+        size_t new_bin = get_partial_bin(g, metadata);
+        if (new_bin != bin) {
+            remove_partial_slab(c, bin, metadata);
+            push_partial_slab(c, new_bin, metadata);
         }
     }
 
-    void *slab = get_slab(c, slab_size, metadata);
+    void *slab = get_slab(g, metadata);
     void *p = slot_pointer(size, slab, slot);
     if (requested_size) {
         write_after_free_check(p, size - canary_size);
@@ -386,6 +1128,48 @@ static inline void *allocate_small(size_t requested_size) {
     return p;
 }
 
+static inline void *allocate_small(size_t requested_size) {
+    struct size_info info = get_size_info(requested_size);
+    size_t size = info.size ? info.size : 16;
+    struct size_class *c = &size_class_metadata[info.class];
+
+    mutex_lock(&c->lock);
+
+    if (get_partial_slab(c) == NULL) {
+        return allocate_from_new_slab(c, size, requested_size, ALL_SLOTS);
+    }
+    return allocate_from_partial_slab(c, size, requested_size, ALL_SLOTS);
+}
+
+// Allocate one of the aligned slots of a size class that's not a multiple of the alignment, in
+// order to avoid moving up to a much larger size class. This fails when the fullest partial slab
+// has no free aligned slots, since searching the other slabs isn't bounded.
+static void *allocate_small_aligned(size_t requested_size, size_t alignment) {
+    struct size_info info = get_size_info(requested_size);
+    if (info.size == 0) {
+        return NULL;
+    }
+    size_t step = alignment / (info.size & -info.size);
+    if (step < 2 || step > 64) {
+        return NULL;
+    }
+    uint64_t pattern = aligned_slot_patterns[__builtin_ctzl(step)];
+    struct size_class *c = &size_class_metadata[info.class];
+
+    mutex_lock(&c->lock);
+
+    struct slab_metadata *metadata = get_partial_slab(c);
+    if (metadata == NULL) {
+        return allocate_from_new_slab(c, info.size, requested_size, pattern);
+    }
+
+    if (!has_free_aligned_slots(get_geometry(c, metadata)->slots, metadata, pattern)) {
+        mutex_unlock(&c->lock);
+        return NULL;
+    }
+    return allocate_from_partial_slab(c, info.size, requested_size, pattern);
+}
+
 static size_t slab_size_class(void *p) {
     size_t offset = (char *)p - (char *)ro.slab_region_start;
     return offset / real_class_region_size;
@@ -395,38 +1179,23 @@ static size_t slab_usable_size(void *p) {
     return size_classes[slab_size_class(p)];
 }
 
-static void enqueue_free_slab(struct size_class *c, struct slab_metadata *metadata) {
-    metadata->next = NULL;
-
-    if (c->free_slabs_tail != NULL) {
-        c->free_slabs_tail->next = metadata;
-    } else {
-        c->free_slabs_head = metadata;
-    }
-    c->free_slabs_tail = metadata;
-}
-
-static inline void deallocate_small(void *p, size_t *expected_size) {
-    size_t class = slab_size_class(p);
-
-    struct size_class *c = &size_class_metadata[class];
+// free a slot with the size class lock held
+static inline void deallocate_small_locked(struct size_class *c, size_t class, void *p) {
     size_t size = size_classes[class];
-    if (expected_size && size != *expected_size) {
-        fatal_error("sized deallocation mismatch");
-    }
     bool is_zero_size = size == 0;
     if (is_zero_size) {
         size = 16;
     }
-    size_t slots = size_class_slots[class];
-    size_t slab_size = get_slab_size(slots, size);
-
-    mutex_lock(&c->lock);
 
     struct slab_metadata *metadata = get_metadata(c, p);
-    void *slab = get_slab(c, slab_size, metadata);
+    struct slab_geometry *g = get_geometry(c, metadata);
+    void *slab = get_slab(g, metadata);
     size_t slot = libdivide_u32_do((char *)p - (char *)slab, &c->size_divisor);
 
+    if (SLAB_POWER_OF_TWO_STRIDE && unlikely(slot >= g->slots)) {
+        fatal_error("invalid free within a slab stride guard");
+    }
+
     if (slot_pointer(size, slab, slot) != p) {
         fatal_error("invalid unaligned free");
     }
@@ -449,53 +1218,198 @@ static inline void deallocate_small(void *p, size_t *expected_size) {
         }
     }
 
-    if (!has_free_slots(slots, metadata)) {
-        metadata->next = c->partial_slabs;
-        metadata->prev = NULL;
+    if (SLAB_QUARANTINE && c->quarantine_capacity) {
+        uint64_t *quarantine = &get_quarantine(g->slots, metadata)[slot / 64];
+        uint64_t bit = 1UL << (slot % 64);
+        if (*quarantine & bit) {
+            fatal_error("double free (quarantine)");
+        }
+        *quarantine |= bit;
 
-        if (c->partial_slabs) {
-            c->partial_slabs->prev = metadata;
+        if (c->quarantine_count == c->quarantine_capacity) {
+            release_quarantine_batch(c, size, is_zero_size);
         }
-        c->partial_slabs = metadata;
+        c->quarantine[c->quarantine_count++] = p;
+        return;
     }
 
-    clear_slot(metadata, slot);
+    release_slot(c, metadata, slot, is_zero_size);
+}
 
-    if (is_free_slab(metadata)) {
-        if (metadata->prev) {
-            metadata->prev->next = metadata->next;
-        } else {
-            c->partial_slabs = metadata->next;
+static inline void deallocate_small(void *p, size_t *expected_size) {
+    size_t class = slab_size_class(p);
+
+    struct size_class *c = &size_class_metadata[class];
+    if (expected_size && size_classes[class] != *expected_size) {
+        fatal_error("sized deallocation mismatch");
+    }
+
+    mutex_lock(&c->lock);
+    deallocate_small_locked(c, class, p);
+    mutex_unlock(&c->lock);
+}
+
+#define THREAD_FREE_BATCH_LENGTH 32
+
+// Allocator state for a thread, found through a pthread key by the thread itself and through the
+// registry by h_malloc_trim, h_malloc_disable and fork. The lock is only contended while another
+// thread flushes the record.
+struct thread_record {
+    struct mutex lock;
+    struct thread_record *next;
+    struct thread_record *prev;
+
+    // small allocations freed by the thread and not yet returned to their size classes
+    size_t free_count;
+    void *free_batch[THREAD_FREE_BATCH_LENGTH];
+};
+
+// value of the pthread key for threads past their record destructor
+#define THREAD_EXITED ((struct thread_record *)1)
+
+static struct mutex threads_lock = MUTEX_INITIALIZER;
+static struct thread_record *threads; // doubly-linked list of registered records
+static struct thread_record *free_thread_records; // recycled from exited threads
+
+// free the batch grouped by size class to take each size class lock once
+static void flush_thread_record(struct thread_record *record) {
+    size_t count = record->free_count;
+    while (count) {
+        size_t class = slab_size_class(record->free_batch[0]);
+        struct size_class *c = &size_class_metadata[class];
+
+        size_t kept = 0;
+        mutex_lock(&c->lock);
+        for (size_t i = 0; i < count; i++) {
+            void *p = record->free_batch[i];
+            if (slab_size_class(p) == class) {
+                deallocate_small_locked(c, class, p);
+            } else {
+                record->free_batch[kept++] = p;
+            }
         }
-        if (metadata->next) {
-            metadata->next->prev = metadata->prev;
+        mutex_unlock(&c->lock);
+        count = kept;
+    }
+    record->free_count = 0;
+}
+
+static void flush_thread_records(void) {
+    mutex_lock(&threads_lock);
+    for (struct thread_record *record = threads; record != NULL; record = record->next) {
+        mutex_lock(&record->lock);
+        flush_thread_record(record);
+        mutex_unlock(&record->lock);
+    }
+    mutex_unlock(&threads_lock);
+}
+
+// requires threads_lock
+static void unregister_thread_record(struct thread_record *record) {
+    if (record->prev) {
+        record->prev->next = record->next;
+    } else {
+        threads = record->next;
+    }
+    if (record->next) {
+        record->next->prev = record->prev;
+    }
+
+    record->next = free_thread_records;
+    free_thread_records = record;
+}
+
+static struct thread_record *register_thread_record(void) {
+    mutex_lock(&threads_lock);
+    struct thread_record *record = free_thread_records;
+    if (record != NULL) {
+        free_thread_records = record->next;
+    } else {
+        record = allocate_pages(sizeof(struct thread_record), PAGE_SIZE, true);
+        if (record == NULL) {
+            mutex_unlock(&threads_lock);
+            return NULL;
         }
+    }
+    mutex_init(&record->lock);
+    record->free_count = 0;
+    record->prev = NULL;
+    record->next = threads;
+    if (threads) {
+        threads->prev = record;
+    }
+    threads = record;
+    mutex_unlock(&threads_lock);
+
+    // may allocate, but doesn't free
+    if (pthread_setspecific(ro.thread_key, record)) {
+        mutex_lock(&threads_lock);
+        unregister_thread_record(record);
+        mutex_unlock(&threads_lock);
+        return NULL;
+    }
+    return record;
+}
 
-        metadata->prev = NULL;
+static void thread_record_destructor(void *arg) {
+    struct thread_record *record = arg;
+    if (record != THREAD_EXITED) {
+        mutex_lock(&record->lock);
+        flush_thread_record(record);
+        mutex_unlock(&record->lock);
 
-        if (c->empty_slabs_total + slab_size > max_empty_slabs_total) {
-            if (!memory_map_fixed(slab, slab_size)) {
-                enqueue_free_slab(c, metadata);
-                mutex_unlock(&c->lock);
-                return;
-            }
-            // handle out-of-memory by just putting it into the empty slabs list
-        }
+        mutex_lock(&threads_lock);
+        unregister_thread_record(record);
+        mutex_unlock(&threads_lock);
+    }
+
+    // Frees from later destructors go directly to the size classes rather than registering a
+    // record that would never be flushed. This runs again for each remaining destructor iteration
+    // and the value is left in place after the last one.
+    pthread_setspecific(ro.thread_key, THREAD_EXITED);
+}
 
-        metadata->next = c->empty_slabs;
-        c->empty_slabs = metadata;
-        c->empty_slabs_total += slab_size;
+static void deallocate_small_deferred(void *p, size_t *expected_size) {
+    if (expected_size && slab_usable_size(p) != *expected_size) {
+        fatal_error("sized deallocation mismatch");
     }
 
-    mutex_unlock(&c->lock);
+    struct thread_record *record = pthread_getspecific(ro.thread_key);
+    if (unlikely(record == NULL)) {
+        record = register_thread_record();
+    }
+    if (unlikely(record == NULL || record == THREAD_EXITED)) {
+        deallocate_small(p, NULL);
+        return;
+    }
+
+    mutex_lock(&record->lock);
+    for (size_t i = 0; i < record->free_count; i++) {
+        if (record->free_batch[i] == p) {
+            fatal_error("double free (thread batch)");
+        }
+    }
+    if (record->free_count == THREAD_FREE_BATCH_LENGTH) {
+        flush_thread_record(record);
+    }
+    record->free_batch[record->free_count++] = p;
+    mutex_unlock(&record->lock);
 }
 
 struct region_info {
     void *p;
     size_t size;
     size_t guard_size;
+    size_t page_size;
 };
 
+static const size_t huge_page_size = 2 * 1024 * 1024;
+static const size_t hugetlb_threshold = HUGETLB_THRESHOLD;
+
+static size_t get_mapped_size(size_t size, size_t page_size) {
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
 static const size_t initial_region_table_size = 256;
 static const size_t max_region_table_size = class_region_size / PAGE_SIZE;
 
@@ -515,7 +1429,9 @@ static size_t hash_page(void *p) {
 }
 
 static int regions_grow(void) {
+    trace_slow_path(SLOW_PATH_REGIONS_GROW);
     if (regions_total > SIZE_MAX / sizeof(struct region_info) / 2) {
+        errno = ENOSPC;
         return 1;
     }
 
@@ -524,6 +1440,7 @@ static int regions_grow(void) {
     size_t mask = newtotal - 1;
 
     if (newtotal > max_region_table_size) {
+        errno = ENOSPC;
         return 1;
     }
 
@@ -552,7 +1469,7 @@ static int regions_grow(void) {
     return 0;
 }
 
-static int regions_insert(void *p, size_t size, size_t guard_size) {
+static int regions_insert(void *p, size_t size, size_t guard_size, size_t page_size) {
     if (regions_free * 4 < regions_total) {
         if (regions_grow()) {
             return 1;
@@ -569,7 +1486,9 @@ static int regions_insert(void *p, size_t size, size_t guard_size) {
     regions[index].p = p;
     regions[index].size = size;
     regions[index].guard_size = guard_size;
+    regions[index].page_size = page_size;
     regions_free--;
+    atomic_fetch_add_explicit(&regions_committed, get_mapped_size(size, page_size), memory_order_relaxed);
     return 0;
 }
 
@@ -588,6 +1507,8 @@ static void regions_delete(struct region_info *region) {
     size_t mask = regions_total - 1;
 
     regions_free++;
+    atomic_fetch_sub_explicit(&regions_committed, get_mapped_size(region->size, region->page_size),
+                              memory_order_relaxed);
 
     size_t i = region - regions;
     for (;;) {
@@ -610,6 +1531,10 @@ static void regions_delete(struct region_info *region) {
 }
 
 static void full_lock(void) {
+    mutex_lock(&threads_lock);
+    for (struct thread_record *record = threads; record != NULL; record = record->next) {
+        mutex_lock(&record->lock);
+    }
     mutex_lock(&regions_lock);
     for (unsigned class = 0; class < N_SIZE_CLASSES; class++) {
         mutex_lock(&size_class_metadata[class].lock);
@@ -617,6 +1542,10 @@ static void full_lock(void) {
 }
 
 static void full_unlock(void) {
+    for (struct thread_record *record = threads; record != NULL; record = record->next) {
+        mutex_unlock(&record->lock);
+    }
+    mutex_unlock(&threads_lock);
     mutex_unlock(&regions_lock);
     for (unsigned class = 0; class < N_SIZE_CLASSES; class++) {
         mutex_unlock(&size_class_metadata[class].lock);
@@ -626,10 +1555,51 @@ static void full_unlock(void) {
 static void post_fork_child(void) {
     mutex_init(&regions_lock);
     random_state_init(&regions_rng);
+    if (MEMORY_PRESSURE_MONITOR || CGROUP_CACHE_LIMIT) {
+        // the pressure state and cgroup limit belonged to the parent's scavenger
+        atomic_store_explicit(&memory_pressure, false, memory_order_relaxed);
+        update_empty_slabs_limit();
+        atomic_store_explicit(&scavenger_restart, true, memory_order_relaxed);
+    }
+    if (ASYNC_PURGE) {
+        memory_purge_async_fork_child();
+    }
     for (unsigned class = 0; class < N_SIZE_CLASSES; class++) {
         struct size_class *c = &size_class_metadata[class];
         mutex_init(&c->lock);
         random_state_init(&c->rng);
+
+        // the purges were queued in the parent, so the child may still have the pages
+        for (unsigned geometry = 0; geometry < SLAB_GEOMETRIES; geometry++) {
+            struct slab_geometry *g = &c->geometries[geometry];
+            struct slab_metadata *metadata = g->pending_slabs;
+            while (metadata != NULL) {
+                struct slab_metadata *next = metadata->next;
+                memory_map_fixed(get_slab(g, metadata), g->slab_size);
+                enqueue_free_slab(g, metadata);
+                metadata = next;
+            }
+            g->pending_slabs = NULL;
+            atomic_store_explicit(&g->pending_completed, g->pending_submitted, memory_order_relaxed);
+        }
+    }
+
+    // only the forking thread survives, so the batches of the others are flushed and their
+    // records recycled
+    mutex_init(&threads_lock);
+    struct thread_record *current = NULL;
+    if (THREAD_FREE_BATCH) {
+        current = pthread_getspecific(ro.thread_key);
+    }
+    struct thread_record *record = threads;
+    while (record != NULL) {
+        struct thread_record *next = record->next;
+        mutex_init(&record->lock);
+        if (record != current) {
+            flush_thread_record(record);
+            unregister_thread_record(record);
+        }
+        record = next;
     }
 }
 
@@ -657,9 +1627,25 @@ COLD static void init_slow_path(void) {
         fatal_error("page size mismatch");
     }
 
+    update_empty_slabs_limit();
+
+#ifdef __x86_64__
+    // may be called before the constructor initializing the CPU feature data
+    __builtin_cpu_init();
+    ro.has_bmi2 = __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+#endif
+
+    if (ASYNC_PURGE) {
+        memory_purge_async_init();
+    }
+
+    if (THREAD_FREE_BATCH && pthread_key_create(&ro.thread_key, thread_record_destructor)) {
+        fatal_error("failed to create thread key");
+    }
+
     random_state_init(&regions_rng);
     for (unsigned i = 0; i < 2; i++) {
-        ro.regions[i] = allocate_pages(max_region_table_size, PAGE_SIZE, false);
+        ro.regions[i] = allocate_pages(max_region_table_size * sizeof(struct region_info), PAGE_SIZE, false);
         if (ro.regions[i] == NULL) {
             fatal_error("failed to reserve memory for regions table");
         }
@@ -690,16 +1676,36 @@ COLD static void init_slow_path(void) {
             size = 16;
         }
         c->size_divisor = libdivide_u32_gen(size);
-        size_t slab_size = get_slab_size(size_class_slots[class], size);
-        c->slab_size_divisor = libdivide_u64_gen(slab_size);
-        size_t metadata_max = get_metadata_max(slab_size);
-        c->slab_info = allocate_pages(metadata_max * sizeof(struct slab_metadata), PAGE_SIZE, false);
-        if (c->slab_info == NULL) {
-            fatal_error("failed to allocate slab metadata");
+        c->quarantine_capacity = SLAB_QUARANTINE_SIZE / size;
+        if (c->quarantine_capacity > SLAB_QUARANTINE_LENGTH) {
+            c->quarantine_capacity = SLAB_QUARANTINE_LENGTH;
         }
-        c->metadata_allocated = PAGE_SIZE / sizeof(struct slab_metadata);
-        if (memory_protect_rw(c->slab_info, c->metadata_allocated * sizeof(struct slab_metadata))) {
-            fatal_error("failed to allocate initial slab info");
+
+        for (unsigned geometry = 0; geometry < SLAB_GEOMETRIES; geometry++) {
+            struct slab_geometry *g = &c->geometries[geometry];
+            g->region_start = (char *)c->class_region_start + geometry * geometry_region_size;
+            g->slots = geometry == GEOMETRY_HOT ? size_class_slots[class] : size_class_slots_cold[class];
+            g->partial_bin_scale = 65536 / g->slots;
+            g->slab_size = get_slab_size(g->slots, size);
+            g->slab_stride = g->slab_size;
+            if (SLAB_POWER_OF_TWO_STRIDE) {
+                g->slab_stride_shift = 64 - __builtin_clzl(g->slab_size - 1);
+                g->slab_stride = (size_t)1 << g->slab_stride_shift;
+            }
+            g->slab_stride_divisor = libdivide_u64_gen(g->slab_stride);
+            g->metadata_size = get_metadata_size(g->slots);
+            size_t metadata_max = get_metadata_max(g->slab_stride);
+            g->slab_info = allocate_pages(metadata_max * g->metadata_size, PAGE_SIZE, false);
+            if (g->slab_info == NULL) {
+                fatal_error("failed to allocate slab metadata");
+            }
+            g->metadata_allocated = PAGE_SIZE / g->metadata_size;
+            if (g->metadata_allocated > metadata_max) {
+                g->metadata_allocated = metadata_max;
+            }
+            if (memory_protect_rw(g->slab_info, g->metadata_allocated * g->metadata_size)) {
+                fatal_error("failed to allocate initial slab info");
+            }
         }
     }
 
@@ -715,6 +1721,10 @@ COLD static void init_slow_path(void) {
     if (pthread_atfork(full_lock, full_unlock, post_fork_child)) {
         fatal_error("pthread_atfork failed");
     }
+
+    if (MEMORY_PRESSURE_MONITOR || CGROUP_CACHE_LIMIT) {
+        start_scavenger();
+    }
 }
 
 static inline void init(void) {
@@ -733,24 +1743,41 @@ static size_t get_guard_size(struct random_state *state, size_t size) {
     return (get_random_u64_uniform(state, size / PAGE_SIZE / 8) + 1) * PAGE_SIZE;
 }
 
-static void *allocate(size_t size) {
-    if (size <= max_slab_size_class) {
-        return allocate_small(size);
+// Map a large allocation, from the hugetlb pool if it's above the threshold and the pool isn't
+// exhausted, and otherwise with regular pages.
+static void *allocate_large_pages(size_t size, size_t alignment, size_t guard_size, size_t *page_size) {
+    if (hugetlb_threshold && size >= hugetlb_threshold && alignment <= huge_page_size) {
+        void *p = allocate_pages_huge(size, guard_size, huge_page_size);
+        if (p != NULL) {
+            *page_size = huge_page_size;
+            return p;
+        }
     }
 
+    *page_size = PAGE_SIZE;
+    if (alignment <= PAGE_SIZE) {
+        return allocate_pages(size, guard_size, true);
+    }
+    return allocate_pages_aligned(size, alignment, guard_size);
+}
+
+static void *allocate_large(size_t size, size_t alignment) {
+    check_budget(PAGE_CEILING(size));
+
     mutex_lock(&regions_lock);
     size_t guard_size = get_guard_size(&regions_rng, size);
     mutex_unlock(&regions_lock);
 
-    void *p = allocate_pages(size, guard_size, true);
+    size_t page_size;
+    void *p = allocate_large_pages(size, alignment, guard_size, &page_size);
     if (p == NULL) {
         return NULL;
     }
 
     mutex_lock(&regions_lock);
-    if (regions_insert(p, size, guard_size)) {
+    if (regions_insert(p, size, guard_size, page_size)) {
         mutex_unlock(&regions_lock);
-        deallocate_pages(p, size, guard_size);
+        deallocate_pages(p, get_mapped_size(size, page_size), guard_size);
         return NULL;
     }
     mutex_unlock(&regions_lock);
@@ -758,6 +1785,17 @@ static void *allocate(size_t size) {
     return p;
 }
 
+static void *allocate(size_t size) {
+    void *p = size <= max_slab_size_class ? allocate_small(size) : allocate_large(size, PAGE_SIZE);
+    if (unlikely(p == NULL) && handle_out_of_memory(size)) {
+        p = size <= max_slab_size_class ? allocate_small(size) : allocate_large(size, PAGE_SIZE);
+        if (p == NULL) {
+            errno = ENOMEM;
+        }
+    }
+    return p;
+}
+
 static void deallocate_large(void *p, size_t *expected_size) {
     enforce_init();
 
@@ -771,10 +1809,11 @@ static void deallocate_large(void *p, size_t *expected_size) {
         fatal_error("sized deallocation mismatch");
     }
     size_t guard_size = region->guard_size;
+    size_t page_size = region->page_size;
     regions_delete(region);
     mutex_unlock(&regions_lock);
 
-    deallocate_pages(p, size, guard_size);
+    deallocate_pages(p, get_mapped_size(size, page_size), guard_size);
 }
 
 static size_t adjust_size_for_canaries(size_t size) {
@@ -784,10 +1823,69 @@ static size_t adjust_size_for_canaries(size_t size) {
     return size;
 }
 
+static size_t get_size_class(void *p) {
+    if (p >= ro.slab_region_start && p < ro.slab_region_end) {
+        return slab_size_class(p);
+    }
+    return H_MALLOC_LARGE_CLASS;
+}
+
+// published by h_malloc_set_hooks, or NULL without hooks
+static _Atomic(const struct h_malloc_hooks *) hooks;
+
+COLD static void notify_alloc(void *p, size_t size) {
+    const struct h_malloc_hooks *h = atomic_load_explicit(&hooks, memory_order_acquire);
+    if (h != NULL && h->alloc != NULL) {
+        h->alloc(p, size, get_size_class(p), h->arg);
+    }
+}
+
+COLD static void notify_free(void *p) {
+    const struct h_malloc_hooks *h = atomic_load_explicit(&hooks, memory_order_acquire);
+    if (h == NULL || h->free == NULL) {
+        return;
+    }
+
+    size_t class = get_size_class(p);
+    size_t size;
+    if (class != H_MALLOC_LARGE_CLASS) {
+        size = size_classes[class] ? size_classes[class] - canary_size : 0;
+    } else {
+        enforce_init();
+        mutex_lock(&regions_lock);
+        struct region_info *region = regions_find(p);
+        if (region == NULL) {
+            fatal_error("invalid free");
+        }
+        size = region->size;
+        mutex_unlock(&regions_lock);
+    }
+    h->free(p, size, class, h->arg);
+}
+
+COLD static void notify_realloc(void *old, void *new, size_t size) {
+    const struct h_malloc_hooks *h = atomic_load_explicit(&hooks, memory_order_acquire);
+    if (h != NULL && h->realloc != NULL) {
+        h->realloc(old, new, size, get_size_class(new), h->arg);
+    }
+}
+
+// The hooks are published as a single pointer, so checking for them is a relaxed load and a
+// predictable branch.
+static inline bool hooks_enabled(void) {
+    return unlikely(atomic_load_explicit(&hooks, memory_order_relaxed) != NULL);
+}
+
+static inline void *hook_alloc(void *p, size_t size) {
+    if (hooks_enabled() && p != NULL) {
+        notify_alloc(p, size);
+    }
+    return p;
+}
+
 EXPORT void *h_malloc(size_t size) {
     init();
-    size = adjust_size_for_canaries(size);
-    return allocate(size);
+    return hook_alloc(allocate(adjust_size_for_canaries(size)), size);
 }
 
 EXPORT void *h_calloc(size_t nmemb, size_t size) {
@@ -797,9 +1895,10 @@ EXPORT void *h_calloc(size_t nmemb, size_t size) {
         return NULL;
     }
     init();
+    size_t requested_size = total_size;
     total_size = adjust_size_for_canaries(total_size);
     if (ZERO_ON_FREE) {
-        return allocate(total_size);
+        return hook_alloc(allocate(total_size), requested_size);
     }
     void *p = allocate(total_size);
     if (unlikely(p == NULL)) {
@@ -808,12 +1907,12 @@ EXPORT void *h_calloc(size_t nmemb, size_t size) {
     if (size && size <= max_slab_size_class) {
         memset(p, 0, total_size - canary_size);
     }
-    return p;
+    return hook_alloc(p, requested_size);
 }
 
 static const size_t mremap_threshold = 4 * 1024 * 1024;
 
-EXPORT void *h_realloc(void *old, size_t size) {
+static void *reallocate(void *old, size_t size) {
     if (old == NULL) {
         init();
         size = adjust_size_for_canaries(size);
@@ -838,15 +1937,21 @@ EXPORT void *h_realloc(void *old, size_t size) {
         }
         old_size = region->size;
         size_t old_guard_size = region->guard_size;
-        if (PAGE_CEILING(old_size) == PAGE_CEILING(size)) {
+        size_t old_page_size = region->page_size;
+        if (get_mapped_size(old_size, old_page_size) == get_mapped_size(size, old_page_size) &&
+                size > max_slab_size_class) {
             region->size = size;
             mutex_unlock(&regions_lock);
             return old;
         }
         mutex_unlock(&regions_lock);
 
+        // huge pages can't be partially unmapped or remapped to a regular mapping, so they're
+        // always reallocated with a copy
+        bool is_huge = old_page_size != PAGE_SIZE;
+
         // in-place shrink
-        if (size < old_size && size > max_slab_size_class) {
+        if (!is_huge && size < old_size && size > max_slab_size_class) {
             size_t rounded_size = PAGE_CEILING(size);
             size_t old_rounded_size = PAGE_CEILING(old_size);
 
@@ -863,19 +1968,22 @@ EXPORT void *h_realloc(void *old, size_t size) {
                 fatal_error("invalid realloc");
             }
             region->size = size;
+            atomic_fetch_sub_explicit(&regions_committed, old_rounded_size - rounded_size, memory_order_relaxed);
             mutex_unlock(&regions_lock);
 
             return old;
         }
 
         size_t copy_size = size < old_size ? size : old_size;
-        if (copy_size >= mremap_threshold) {
+        if (!is_huge && copy_size >= mremap_threshold) {
             void *new = allocate(size);
             if (new == NULL) {
                 return NULL;
             }
 
             mutex_lock(&regions_lock);
+            // regular pages can't be moved over part of a hugetlb mapping
+            bool is_new_huge = regions_find(new)->page_size != PAGE_SIZE;
             struct region_info *region = regions_find(old);
             if (region == NULL) {
                 fatal_error("invalid realloc");
@@ -883,7 +1991,7 @@ EXPORT void *h_realloc(void *old, size_t size) {
             regions_delete(region);
             mutex_unlock(&regions_lock);
 
-            if (memory_remap_fixed(old, old_size, new, size)) {
+            if (is_new_huge || memory_remap_fixed(old, old_size, new, size)) {
                 memcpy(new, old, copy_size);
                 deallocate_pages(old, old_size, old_guard_size);
             } else {
@@ -899,7 +2007,7 @@ EXPORT void *h_realloc(void *old, size_t size) {
         return NULL;
     }
     size_t copy_size = size < old_size ? size : old_size;
-    if (size > 0 && size <= max_slab_size_class) {
+    if (copy_size > 0 && copy_size <= max_slab_size_class) {
         copy_size -= canary_size;
     }
     memcpy(new, old, copy_size);
@@ -911,41 +2019,40 @@ EXPORT void *h_realloc(void *old, size_t size) {
     return new;
 }
 
-static int alloc_aligned(void **memptr, size_t alignment, size_t size, size_t min_alignment) {
-    if ((alignment - 1) & alignment || alignment < min_alignment) {
-        return EINVAL;
+EXPORT void *h_realloc(void *old, size_t size) {
+    void *new = reallocate(old, size);
+    if (hooks_enabled() && new != NULL) {
+        notify_realloc(old, new, size);
     }
+    return new;
+}
 
-    if (alignment <= PAGE_SIZE) {
-        if (size <= max_slab_size_class && alignment > min_align) {
-            size = get_size_info_align(size, alignment).size;
-        }
-
-        void *p = allocate(size);
-        if (p == NULL) {
-            return ENOMEM;
+static void *allocate_aligned(size_t size, size_t alignment) {
+    if (alignment > PAGE_SIZE) {
+        return allocate_large(size, alignment);
+    }
+    if (size <= max_slab_size_class && alignment > min_align) {
+        void *p = allocate_small_aligned(size, alignment);
+        if (p != NULL) {
+            return p;
         }
-        *memptr = p;
-        return 0;
+        size = get_size_info_align(size, alignment).size;
     }
+    return size <= max_slab_size_class ? allocate_small(size) : allocate_large(size, PAGE_SIZE);
+}
 
-    mutex_lock(&regions_lock);
-    size_t guard_size = get_guard_size(&regions_rng, size);
-    mutex_unlock(&regions_lock);
-
-    void *p = allocate_pages_aligned(size, alignment, guard_size);
-    if (p == NULL) {
-        return ENOMEM;
+static int alloc_aligned(void **memptr, size_t alignment, size_t size, size_t min_alignment) {
+    if ((alignment - 1) & alignment || alignment < min_alignment) {
+        return EINVAL;
     }
 
-    mutex_lock(&regions_lock);
-    if (regions_insert(p, size, guard_size)) {
-        mutex_unlock(&regions_lock);
-        deallocate_pages(p, size, guard_size);
+    void *p = allocate_aligned(size, alignment);
+    if (unlikely(p == NULL) && handle_out_of_memory(size)) {
+        p = allocate_aligned(size, alignment);
+    }
+    if (p == NULL) {
         return ENOMEM;
     }
-    mutex_unlock(&regions_lock);
-
     *memptr = p;
     return 0;
 }
@@ -962,22 +2069,23 @@ static void *alloc_aligned_simple(size_t alignment, size_t size) {
 
 EXPORT int h_posix_memalign(void **memptr, size_t alignment, size_t size) {
     init();
-    size = adjust_size_for_canaries(size);
-    return alloc_aligned(memptr, alignment, size, sizeof(void *));
+    int ret = alloc_aligned(memptr, alignment, adjust_size_for_canaries(size), sizeof(void *));
+    if (hooks_enabled() && !ret) {
+        notify_alloc(*memptr, size);
+    }
+    return ret;
 }
 
 EXPORT void *h_aligned_alloc(size_t alignment, size_t size) {
     init();
-    size = adjust_size_for_canaries(size);
-    return alloc_aligned_simple(alignment, size);
+    return hook_alloc(alloc_aligned_simple(alignment, adjust_size_for_canaries(size)), size);
 }
 
 EXPORT void *h_memalign(size_t alignment, size_t size) ALIAS(h_aligned_alloc);
 
 EXPORT void *h_valloc(size_t size) {
     init();
-    size = adjust_size_for_canaries(size);
-    return alloc_aligned_simple(PAGE_SIZE, size);
+    return hook_alloc(alloc_aligned_simple(PAGE_SIZE, adjust_size_for_canaries(size)), size);
 }
 
 EXPORT void *h_pvalloc(size_t size) {
@@ -987,8 +2095,7 @@ EXPORT void *h_pvalloc(size_t size) {
         return NULL;
     }
     init();
-    size = adjust_size_for_canaries(size);
-    return alloc_aligned_simple(PAGE_SIZE, rounded);
+    return hook_alloc(alloc_aligned_simple(PAGE_SIZE, rounded), size);
 }
 
 EXPORT void h_free(void *p) {
@@ -996,7 +2103,15 @@ EXPORT void h_free(void *p) {
         return;
     }
 
+    if (hooks_enabled()) {
+        notify_free(p);
+    }
+
     if (p >= ro.slab_region_start && p < ro.slab_region_end) {
+        if (THREAD_FREE_BATCH) {
+            deallocate_small_deferred(p, NULL);
+            return;
+        }
         deallocate_small(p, NULL);
         return;
     }
@@ -1011,8 +2126,16 @@ EXPORT void h_free_sized(void *p, size_t expected_size) {
         return;
     }
 
+    if (hooks_enabled()) {
+        notify_free(p);
+    }
+
     if (p >= ro.slab_region_start && p < ro.slab_region_end) {
         expected_size = get_size_info(adjust_size_for_canaries(expected_size)).size;
+        if (THREAD_FREE_BATCH) {
+            deallocate_small_deferred(p, &expected_size);
+            return;
+        }
         deallocate_small(p, &expected_size);
         return;
     }
@@ -1082,43 +2205,127 @@ EXPORT size_t h_malloc_object_size_fast(void *p) {
     return SIZE_MAX;
 }
 
-EXPORT int h_mallopt(UNUSED int param, UNUSED int value) {
-    return 0;
+// serializes publishing runtime settings
+static struct mutex settings_lock = MUTEX_INITIALIZER;
+
+// Settings changed at runtime are published as immutable copies in their own pages rather than in
+// the read-only state, which is never made writable again after init. A copy is never reused or
+// freed since readers can still be using it after it's replaced.
+static char *settings_page;
+static size_t settings_offset = PAGE_SIZE;
+
+static const void *settings_publish(const void *data, size_t size) {
+    mutex_lock(&settings_lock);
+    size_t offset = (settings_offset + min_align - 1) & ~(min_align - 1);
+    if (offset + size > PAGE_SIZE) {
+        settings_page = memory_map(PAGE_SIZE);
+        if (settings_page == NULL) {
+            fatal_error("failed to allocate settings");
+        }
+        offset = 0;
+    }
+    if (memory_protect_rw(settings_page, PAGE_SIZE)) {
+        fatal_error("failed to unprotect settings");
+    }
+    memcpy(settings_page + offset, data, size);
+    if (memory_protect_ro(settings_page, PAGE_SIZE)) {
+        fatal_error("failed to protect settings");
+    }
+    settings_offset = offset + size;
+    mutex_unlock(&settings_lock);
+    return settings_page + offset;
 }
 
-EXPORT int h_malloc_trim(UNUSED size_t pad) {
-    if (unlikely(!is_init())) {
-        return 0;
+EXPORT void h_malloc_set_budget(size_t budget, void (*callback)(size_t committed, void *arg), void *arg) {
+    init();
+    const struct budget_settings *settings = NULL;
+    if (budget || callback != NULL) {
+        struct budget_settings copy = {budget, callback, arg};
+        settings = settings_publish(&copy, sizeof(copy));
     }
+    atomic_store_explicit(&budget_settings, settings, memory_order_release);
+    atomic_store_explicit(&budget_triggered, false, memory_order_relaxed);
+}
 
-    bool is_trimmed = false;
+EXPORT void h_malloc_set_hooks(const struct h_malloc_hooks *new_hooks) {
+    init();
+    const struct h_malloc_hooks *published = NULL;
+    if (new_hooks != NULL &&
+            (new_hooks->alloc != NULL || new_hooks->free != NULL || new_hooks->realloc != NULL)) {
+        published = settings_publish(new_hooks, sizeof(*new_hooks));
+    }
+    atomic_store_explicit(&hooks, published, memory_order_release);
+}
 
-    // skip zero byte size class since there's nothing to change
-    for (unsigned class = 1; class < N_SIZE_CLASSES; class++) {
-        struct size_class *c = &size_class_metadata[class];
-        size_t slab_size = get_slab_size(size_class_slots[class], size_classes[class]);
+static size_t count_used_slots(size_t slots, struct slab_metadata *metadata) {
+    size_t used = 0;
+    for (size_t leaf = 0; leaf < get_leaves(slots); leaf++) {
+        used += __builtin_popcountl(get_live_slots(slots, metadata, leaf));
+    }
+    return used;
+}
 
-        mutex_lock(&c->lock);
-        struct slab_metadata *iterator = c->empty_slabs;
-        while (iterator) {
-            void *slab = get_slab(c, slab_size, iterator);
-            if (memory_map_fixed(slab, slab_size)) {
-                break;
-            }
+EXPORT int h_malloc_utilization(void *p, struct h_malloc_utilization *utilization) {
+    if (!(p >= ro.slab_region_start && p < ro.slab_region_end)) {
+        return -1;
+    }
 
-            struct slab_metadata *trimmed = iterator;
-            iterator = iterator->next;
-            c->empty_slabs_total -= slab_size;
+    size_t class = slab_size_class(p);
+    struct size_class *c = &size_class_metadata[class];
+    size_t size = size_classes[class];
 
-            enqueue_free_slab(c, trimmed);
+    mutex_lock(&c->lock);
 
-            is_trimmed = true;
+    struct slab_metadata *metadata = get_metadata(c, p);
+    struct slab_geometry *g = get_geometry(c, metadata);
+    size_t slots = g->slots;
+    size_t used = count_used_slots(slots, metadata);
+
+    // rank the slab among the partial slabs by the slabs in the emptier bins
+    bool is_partial = metadata->used != 0 && has_free_slots(slots, metadata);
+    size_t bin = is_partial ? get_partial_bin(g, metadata) : PARTIAL_SLAB_BINS;
+    size_t partial = 0;
+    size_t emptier = 0;
+    for (size_t i = 0; i < PARTIAL_SLAB_BINS; i++) {
+        partial += c->partial_counts[i];
+        if (i > bin) {
+            emptier += c->partial_counts[i];
         }
-        c->empty_slabs = iterator;
-        mutex_unlock(&c->lock);
     }
 
-    return is_trimmed;
+    mutex_unlock(&c->lock);
+
+    utilization->size = size ? size - canary_size : 0;
+    utilization->slots = slots;
+    utilization->used = used;
+    utilization->partial_slabs = partial;
+    utilization->sparse = is_partial && emptier < partial / 4;
+    return 0;
+}
+
+static_assert(N_SLOW_PATHS == H_MALLOC_SLOW_PATHS, "slow path indices out of sync");
+
+EXPORT void h_malloc_slow_paths(uint64_t counts[H_MALLOC_SLOW_PATHS]) {
+#if SLOW_PATH_TRACE
+    memcpy(counts, slow_path_counts, sizeof(slow_path_counts));
+#else
+    memset(counts, 0, H_MALLOC_SLOW_PATHS * sizeof(uint64_t));
+#endif
+}
+
+EXPORT int h_mallopt(UNUSED int param, UNUSED int value) {
+    return 0;
+}
+
+EXPORT int h_malloc_trim(UNUSED size_t pad) {
+    if (unlikely(!is_init())) {
+        return 0;
+    }
+
+    if (THREAD_FREE_BATCH) {
+        flush_thread_records();
+    }
+    return purge_empty_slabs(0, true);
 }
 
 EXPORT void h_malloc_stats(void) {}
@@ -1129,9 +2336,120 @@ EXPORT struct mallinfo h_mallinfo(void) {
 }
 #endif
 
-EXPORT int h_malloc_info(UNUSED int options, UNUSED FILE *fp) {
-    errno = ENOSYS;
-    return -1;
+struct size_class_info {
+    size_t slab_size[SLAB_GEOMETRIES];
+    size_t used_slabs;
+    size_t committed;
+    size_t empty_cached;
+    size_t metadata;
+    size_t quarantined;
+    size_t partial[PARTIAL_SLAB_BINS];
+};
+
+struct large_info {
+    size_t count;
+    size_t committed;
+    size_t hugetlb;
+    size_t guards;
+    size_t metadata;
+};
+
+EXPORT int h_malloc_lock_contention(size_t size_class, struct h_malloc_lock_contention *contention) {
+    struct mutex *m;
+    if (size_class == H_MALLOC_LARGE_CLASS) {
+        contention->size = 0;
+        m = &regions_lock;
+    } else if (size_class < N_SIZE_CLASSES) {
+        contention->size = size_classes[size_class];
+        m = &size_class_metadata[size_class].lock;
+    } else {
+        return -1;
+    }
+
+    contention->acquired = 0;
+    contention->contended = 0;
+#if LOCK_CONTENTION_TRACE
+    if (is_init()) {
+        mutex_lock(m);
+        // excluding this acquisition
+        contention->acquired = m->acquired - 1;
+        contention->contended = m->contended;
+        mutex_unlock(m);
+    }
+#else
+    (void)m;
+#endif
+    return 0;
+}
+
+// The counts are copied out under the locks and then printed without them, since stdio can call
+// back into the allocator.
+EXPORT int h_malloc_info(int options, FILE *fp) {
+    if (options != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    static const struct size_class_info empty_class_info;
+    struct large_info large = {0};
+    size_t total_metadata = 0;
+
+    fputs("<malloc version=\"hardened_malloc-1\">\n", fp);
+
+    if (is_init()) {
+        for (unsigned class = 1; class < N_SIZE_CLASSES; class++) {
+            struct size_class *c = &size_class_metadata[class];
+            struct size_class_info info = empty_class_info;
+
+            mutex_lock(&c->lock);
+            for (unsigned i = 0; i < SLAB_GEOMETRIES; i++) {
+                struct slab_geometry *g = &c->geometries[i];
+                info.slab_size[i] = g->slab_size;
+                info.metadata += g->metadata_allocated * g->metadata_size;
+            }
+            info.used_slabs = c->used_slabs;
+            info.committed = atomic_load_explicit(&c->committed, memory_order_relaxed);
+            info.empty_cached = c->empty_slabs_total;
+            info.quarantined = c->quarantine_count;
+            memcpy(info.partial, c->partial_counts, sizeof(info.partial));
+            mutex_unlock(&c->lock);
+
+            total_metadata += info.metadata;
+            fprintf(fp, "<size_class index=\"%u\" size=\"%u\" slab_sizes=\"%zu %zu\">"
+                    "<slabs used=\"%zu\" committed=\"%zu\" empty_cached=\"%zu\"/>"
+                    "<metadata size=\"%zu\"/><quarantine count=\"%zu\"/><partial bins=\"",
+                    class, size_classes[class], info.slab_size[0], info.slab_size[1],
+                    info.used_slabs, info.committed, info.empty_cached, info.metadata,
+                    info.quarantined);
+            for (size_t bin = 0; bin < PARTIAL_SLAB_BINS; bin++) {
+                fprintf(fp, bin ? " %zu" : "%zu", info.partial[bin]);
+            }
+            fputs("\"/></size_class>\n", fp);
+        }
+
+        mutex_lock(&regions_lock);
+        for (size_t i = 0; i < regions_total; i++) {
+            if (regions[i].p != NULL) {
+                large.guards += regions[i].guard_size * 2;
+                if (regions[i].page_size != PAGE_SIZE) {
+                    large.hugetlb += get_mapped_size(regions[i].size, regions[i].page_size);
+                }
+            }
+        }
+        large.count = regions_total - regions_free;
+        large.metadata = regions_total * sizeof(struct region_info);
+        mutex_unlock(&regions_lock);
+        large.committed = atomic_load_explicit(&regions_committed, memory_order_relaxed);
+        total_metadata += large.metadata;
+    }
+
+    fprintf(fp, "<total type=\"large\" count=\"%zu\" size=\"%zu\" hugetlb=\"%zu\" guards=\"%zu\"/>\n"
+            "<total type=\"committed\" size=\"%zu\"/>\n"
+            "<total type=\"metadata\" size=\"%zu\"/>\n"
+            "</malloc>\n",
+            large.count, large.committed, large.hugetlb, large.guards, is_init() ? get_committed() : 0,
+            total_metadata);
+    return 0;
 }
 
 COLD EXPORT void *h_malloc_get_state(void) {
@@ -1159,17 +2477,89 @@ EXPORT struct mallinfo __mallinfo_bin_info(UNUSED size_t arena, UNUSED size_t bi
     return (struct mallinfo){0};
 }
 
-COLD EXPORT int h_iterate(UNUSED uintptr_t base, UNUSED size_t size,
-                          UNUSED void (*callback)(uintptr_t ptr, size_t size, void *arg),
-                          UNUSED void *arg) {
-    fatal_error("not implemented");
+#endif
+
+static void iterate_geometry(struct slab_geometry *g, size_t size, size_t usable_size, uintptr_t base,
+                             uintptr_t end, void (*callback)(uintptr_t ptr, size_t size, void *arg),
+                             void *arg) {
+    uintptr_t region_start = (uintptr_t)g->region_start;
+    uintptr_t region_end = region_start + geometry_region_size;
+    if (end <= region_start || base >= region_end) {
+        return;
+    }
+
+    size_t first = base > region_start ? (base - region_start) / g->slab_stride : 0;
+    size_t last = ((end < region_end ? end : region_end) - region_start + g->slab_stride - 1) / g->slab_stride;
+    if (last > g->metadata_count) {
+        last = g->metadata_count;
+    }
+
+    for (size_t index = first; index < last; index++) {
+        struct slab_metadata *metadata = get_slab_metadata(g, index);
+        uintptr_t slab = region_start + index * g->slab_stride;
+        for (size_t leaf = 0; leaf < get_leaves(g->slots); leaf++) {
+            uint64_t bitmap = get_live_slots(g->slots, metadata, leaf);
+            while (bitmap) {
+                size_t slot = leaf * 64 + __builtin_ctzl(bitmap);
+                bitmap &= bitmap - 1;
+                uintptr_t p = slab + slot * size;
+                if (p >= base && p < end) {
+                    callback(p, usable_size, arg);
+                }
+            }
+        }
+    }
+}
+
+static void iterate_slabs(unsigned class, uintptr_t base, uintptr_t end,
+                          void (*callback)(uintptr_t ptr, size_t size, void *arg), void *arg) {
+    struct size_class *c = &size_class_metadata[class];
+    size_t size = size_classes[class];
+    size_t usable_size = size ? size - canary_size : 0;
+    if (size == 0) {
+        size = 16;
+    }
+
+    for (unsigned geometry = 0; geometry < SLAB_GEOMETRIES; geometry++) {
+        iterate_geometry(&c->geometries[geometry], size, usable_size, base, end, callback, arg);
+    }
+}
+
+// Report every live allocation starting within the range. The caller has to hold the allocator
+// locks with h_malloc_disable, so the callback must not call into the allocator.
+COLD EXPORT int h_iterate(uintptr_t base, size_t size,
+                          void (*callback)(uintptr_t ptr, size_t size, void *arg), void *arg) {
+    if (unlikely(!is_init())) {
+        return 0;
+    }
+
+    uintptr_t end;
+    if (__builtin_add_overflow(base, size, &end)) {
+        end = UINTPTR_MAX;
+    }
+
+    for (unsigned class = 0; class < N_SIZE_CLASSES; class++) {
+        iterate_slabs(class, base, end, callback, arg);
+    }
+
+    for (size_t i = 0; i < regions_total; i++) {
+        uintptr_t p = (uintptr_t)regions[i].p;
+        if (p != 0 && p >= base && p < end) {
+            callback(p, regions[i].size, arg);
+        }
+    }
+
+    return 0;
 }
 
 COLD EXPORT void h_malloc_disable(void) {
+    // batched frees would otherwise be reported as live allocations by h_iterate
+    if (THREAD_FREE_BATCH) {
+        flush_thread_records();
+    }
     full_lock();
 }
 
 COLD EXPORT void h_malloc_enable(void) {
     full_unlock();
 }
-#endif
@@ -1,6 +1,8 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <malloc.h>
@@ -28,13 +30,22 @@
 #define h_malloc_get_state malloc_get_state
 #define h_malloc_set_state malloc_set_state
 
+#ifdef __ANDROID__
 #define h_iterate iterate
+#else
+#define h_iterate malloc_iterate
+#endif
 #define h_malloc_disable malloc_disable
 #define h_malloc_enable malloc_enable
 
 #define h_malloc_object_size malloc_object_size
 #define h_malloc_object_size_fast malloc_object_size_fast
 #define h_free_sized free_sized
+#define h_malloc_set_budget malloc_set_budget
+#define h_malloc_set_hooks malloc_set_hooks
+#define h_malloc_utilization malloc_utilization
+#define h_malloc_slow_paths malloc_slow_paths
+#define h_malloc_lock_contention malloc_lock_contention
 #endif
 
 // C standard
@@ -71,11 +82,17 @@ size_t __mallinfo_narenas(void);
 size_t __mallinfo_nbins(void);
 struct mallinfo __mallinfo_arena_info(size_t arena);
 struct mallinfo __mallinfo_bin_info(size_t arena, size_t bin);
+#endif
+
+// Android extensions, also provided on other platforms with iterate named malloc_iterate to avoid
+// exporting a generic symbol
+
+// Report each live allocation starting within the range to the callback. It has to be called
+// between h_malloc_disable and h_malloc_enable, and the callback can't use the allocator.
 int h_iterate(uintptr_t base, size_t size, void (*callback)(uintptr_t ptr, size_t size, void *arg),
               void *arg);
 void h_malloc_disable(void);
 void h_malloc_enable(void);
-#endif
 
 // custom extensions
 
@@ -97,4 +114,69 @@ size_t h_malloc_object_size_fast(void *ptr);
 // passed size matches the allocated size.
 void h_free_sized(void *ptr, size_t expected_size);
 
+// Set a soft limit on the memory committed for slab and large allocations, or 0 to disable it.
+//
+// When an allocation brings the total within 1/8 of the budget, the cached empty slabs are purged
+// and the callback is called with the committed total. The callback is also called after failing
+// to map or commit memory, before the allocation is retried. Requests too large for the address
+// space are neither counted nor retried. Allocations aren't refused based on the budget.
+//
+// The callback is called without any allocator locks held so it's able to free memory.
+void h_malloc_set_budget(size_t budget, void (*callback)(size_t committed, void *arg), void *arg);
+
+// size class passed to the hooks for large allocations
+#define H_MALLOC_LARGE_CLASS SIZE_MAX
+
+// Allocation event hooks, called with the requested size and the index of the size class used
+// for the allocation. The free hook is called before the memory is released with the usable size
+// of the allocation. Allocations made by the hooks are reported to them too.
+struct h_malloc_hooks {
+    void (*alloc)(void *ptr, size_t size, size_t size_class, void *arg);
+    void (*free)(void *ptr, size_t size, size_t size_class, void *arg);
+    void (*realloc)(void *old_ptr, void *new_ptr, size_t size, size_t size_class, void *arg);
+    void *arg;
+};
+
+// Replace the allocation event hooks, or remove them by passing NULL. The hooks are copied, and
+// each event uses the functions and argument from the same call. Without hooks, the only cost is
+// a predictable branch in each API function.
+void h_malloc_set_hooks(const struct h_malloc_hooks *hooks);
+
+struct h_malloc_utilization {
+    size_t size; // usable size of the slots
+    size_t slots; // slots in the slab
+    size_t used; // allocated slots in the slab
+    size_t partial_slabs; // slabs in the size class with both free and allocated slots
+    bool sparse; // under a quarter of the partial slabs are in emptier occupancy bins
+};
+
+// Report the occupancy of the slab containing a small allocation, returning -1 for pointers
+// outside of the slab region. Moving the allocations out of sparse slabs allows them to become
+// empty and then purged. The slab is ranked by its occupancy bin using per-bin slab counts, so
+// this takes constant time.
+int h_malloc_utilization(void *ptr, struct h_malloc_utilization *utilization);
+
+#define H_MALLOC_SLOW_METADATA 0 // slab made usable for the first time
+#define H_MALLOC_SLOW_REACTIVATE 1 // purged slab made usable again
+#define H_MALLOC_SLOW_PURGE 2 // empty slab purged and protected
+#define H_MALLOC_SLOW_REGIONS_GROW 3 // large allocation table grown and rehashed
+#define H_MALLOC_SLOW_RESEED 4 // random state reseeded from the OS
+#define H_MALLOC_SLOW_QUARANTINE_BATCH 5 // batch of quarantined slots released
+#define H_MALLOC_SLOW_PATHS 6
+
+// Copy the number of times the calling thread has taken each slow path, for attributing latency
+// outliers. These are only counted with SLOW_PATH_TRACE in config.h and are zero otherwise.
+void h_malloc_slow_paths(uint64_t counts[H_MALLOC_SLOW_PATHS]);
+
+struct h_malloc_lock_contention {
+    size_t size; // size of the slots, or 0 for the large allocation lock
+    uint64_t acquired; // times the lock was taken
+    uint64_t contended; // times the lock was found already held
+};
+
+// Report the lock usage of a size class, or of the large allocations with H_MALLOC_LARGE_CLASS,
+// returning -1 for indices past the last size class. These are only counted with
+// LOCK_CONTENTION_TRACE in config.h and are zero otherwise.
+int h_malloc_lock_contention(size_t size_class, struct h_malloc_lock_contention *contention);
+
 #endif
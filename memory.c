@@ -1,8 +1,15 @@
 #include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
 
+#include <linux/io_uring.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "memory.h"
+#include "mutex.h"
 #include "util.h"
 
 void *memory_map(size_t size) {
@@ -27,6 +34,38 @@ int memory_map_fixed(void *ptr, size_t size) {
     return 0;
 }
 
+// Map readable and writable pages of the given size from the hugetlb pool, which the kernel aligns
+// to the page size, returning NULL when the pool is exhausted or not supported.
+void *memory_map_huge(size_t size, size_t page_size) {
+    int flags = MAP_ANONYMOUS|MAP_PRIVATE|MAP_HUGETLB|(__builtin_ctzl(page_size) << MAP_HUGE_SHIFT);
+    void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (unlikely(p == MAP_FAILED)) {
+        if (errno != ENOMEM && errno != EINVAL) {
+            fatal_error("non-ENOMEM hugetlb mmap failure");
+        }
+        return NULL;
+    }
+    return p;
+}
+
+// Map inaccessible pages at the given address only if it's free, failing rather than replacing
+// another mapping placed there by the kernel or another thread.
+int memory_map_noreplace(void *ptr, size_t size) {
+    void *p = mmap(ptr, size, PROT_NONE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED_NOREPLACE, -1, 0);
+    if (unlikely(p == MAP_FAILED)) {
+        if (errno != ENOMEM && errno != EEXIST) {
+            fatal_error("non-ENOMEM mmap failure");
+        }
+        return 1;
+    }
+    // kernels before 4.17 treat the flag as a hint
+    if (unlikely(p != ptr)) {
+        memory_unmap(p, size);
+        return 1;
+    }
+    return 0;
+}
+
 int memory_unmap(void *ptr, size_t size) {
     int ret = munmap(ptr, size);
     if (unlikely(ret) && errno != ENOMEM) {
@@ -61,3 +100,241 @@ int memory_remap_fixed(void *old, size_t old_size, void *new, size_t new_size) {
     }
     return 0;
 }
+
+// submissions allowed in flight, with the completion queue sized to never overflow
+static const unsigned purge_ring_entries = 64;
+
+// Ring shared by all size classes for asynchronous purges. The lock is only taken with a size class
+// lock held, so the ring is idle while the allocator is locked for fork. Once broken, no more
+// purges are submitted but the mappings are kept to collect the ones already in flight.
+static struct {
+    struct mutex lock;
+    bool enabled;
+    bool broken;
+    int fd;
+    unsigned in_flight;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+} ring = {.lock = MUTEX_INITIALIZER, .fd = -1};
+
+static bool ring_supports_madvise(int fd) {
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[IORING_OP_MADVISE + 1];
+    } probe;
+    memset(&probe, 0, sizeof(probe));
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &probe, IORING_OP_MADVISE + 1)) {
+        return false;
+    }
+    return probe.probe.last_op >= IORING_OP_MADVISE &&
+        probe.probe.ops[IORING_OP_MADVISE].flags & IO_URING_OP_SUPPORTED;
+}
+
+// Set up the ring, leaving purging synchronous when io_uring is missing, disabled by the
+// kernel.io_uring_disabled sysctl or blocked by seccomp, or lacks madvise support (before 5.6).
+void memory_purge_async_init(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, purge_ring_entries, &params);
+    if (fd == -1) {
+        return;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !ring_supports_madvise(fd)) {
+        close(fd);
+        return;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    char *rings = mmap(NULL, rings_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    void *sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(rings, rings_size);
+        close(fd);
+        return;
+    }
+
+    ring.fd = fd;
+    ring.sq_entries = params.sq_entries;
+    ring.sq_head = (unsigned *)(rings + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring.sq_array = (unsigned *)(rings + params.sq_off.array);
+    ring.sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    ring.cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring.cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    ring.sqes = sqes;
+    ring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring.rings = rings;
+    ring.rings_size = rings_size;
+    ring.sqes_size = sqes_size;
+    ring.enabled = true;
+}
+
+// Index of the ring in the calling thread's registered ring fds plus one, or -1 if registration
+// isn't supported. Initial exec since a dynamic TLS access can allocate.
+static _Thread_local __attribute__((tls_model("initial-exec"))) int ring_registered;
+
+// Use the calling thread's registered ring fd, so the ring keeps working after the application
+// closes or replaces the fd, registering it on first use.
+static int ring_enter_fd(unsigned *flags) {
+    if (ring_registered == 0) {
+        struct io_uring_rsrc_update update = {.offset = -1U, .data = (unsigned)ring.fd};
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+            ring_registered = update.offset + 1;
+        } else {
+            ring_registered = -1;
+        }
+    }
+    if (ring_registered > 0) {
+        *flags |= IORING_ENTER_REGISTERED_RING;
+        return ring_registered - 1;
+    }
+    return ring.fd;
+}
+
+// Stop submitting to the ring and purge the entries the kernel hasn't consumed synchronously.
+// Consumed entries still complete through the mapped rings.
+static void ring_shutdown(void) {
+    ring.broken = true;
+    for (unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE); head != *ring.sq_tail; head++) {
+        struct io_uring_sqe *sqe = &ring.sqes[ring.sq_array[head & ring.sq_mask]];
+        if (madvise((void *)(uintptr_t)sqe->addr, sqe->len, MADV_DONTNEED) && errno != ENOMEM) {
+            fatal_error("non-ENOMEM madvise failure");
+        }
+        atomic_fetch_add_explicit((atomic_size_t *)(uintptr_t)sqe->user_data, 1, memory_order_release);
+        ring.in_flight--;
+    }
+}
+
+// Submit any queued entries, optionally waiting for a completion. The ring is shut down rather
+// than treating errors as fatal since the application can close the fd or the kernel can stop
+// accepting submissions.
+static void ring_enter(unsigned min_complete) {
+    unsigned to_submit = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    if (!to_submit && !min_complete) {
+        return;
+    }
+    int fd = ring_enter_fd(&flags);
+    if (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0) == -1) {
+        // entries left in the queue are submitted by the next call
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ring_shutdown();
+        }
+    }
+}
+
+// count the completed purges, waiting for at least one if requested while any are in flight
+static void ring_reap(bool wait) {
+    for (;;) {
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        bool reaped = head != tail;
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            if (cqe->res < 0 && cqe->res != -ENOMEM) {
+                fatal_error("non-ENOMEM io_uring madvise failure");
+            }
+            atomic_fetch_add_explicit((atomic_size_t *)(uintptr_t)cqe->user_data, 1, memory_order_release);
+            ring.in_flight--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (!wait || reaped || !ring.in_flight) {
+            return;
+        }
+        if (ring.broken) {
+            // completions are posted by task work, run on the next return to userspace
+            sched_yield();
+        } else {
+            ring_enter(1);
+        }
+    }
+}
+
+// Protect the pages immediately and queue an madvise to release them, incrementing completed once
+// it's done. The memory can't be made accessible again until then. Returns false if the purge has
+// to be done synchronously instead.
+bool memory_purge_async(void *ptr, size_t size, atomic_size_t *completed) {
+    if (!ring.enabled) {
+        return false;
+    }
+    if (memory_protect_prot(ptr, size, PROT_NONE)) {
+        return false;
+    }
+
+    mutex_lock(&ring.lock);
+    while (!ring.broken && ring.in_flight == ring.sq_entries) {
+        ring_reap(true);
+    }
+    if (ring.broken) {
+        mutex_unlock(&ring.lock);
+        return false;
+    }
+
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_MADVISE;
+    sqe->addr = (uintptr_t)ptr;
+    sqe->len = size;
+    sqe->fadvise_advice = MADV_DONTNEED;
+    sqe->user_data = (uintptr_t)completed;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.in_flight++;
+
+    ring_enter(0);
+    mutex_unlock(&ring.lock);
+    return true;
+}
+
+// count the purges completed so far, or wait for one to complete
+void memory_purge_async_reap(bool wait) {
+    if (!ring.enabled) {
+        return;
+    }
+    mutex_lock(&ring.lock);
+    ring_reap(wait);
+    mutex_unlock(&ring.lock);
+}
+
+// The ring belongs to the parent's address space, so the child purges synchronously.
+void memory_purge_async_fork_child(void) {
+    if (!ring.enabled) {
+        return;
+    }
+    mutex_init(&ring.lock);
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.rings, ring.rings_size);
+    // a broken ring's fd may have been closed or replaced by the application
+    if (!ring.broken) {
+        close(ring.fd);
+    }
+    ring.fd = -1;
+    ring.in_flight = 0;
+    ring.enabled = false;
+    ring.broken = false;
+}
@@ -1,13 +1,21 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 void *memory_map(size_t size);
 int memory_map_fixed(void *ptr, size_t size);
+void *memory_map_huge(size_t size, size_t page_size);
+int memory_map_noreplace(void *ptr, size_t size);
 int memory_unmap(void *ptr, size_t size);
 int memory_protect_rw(void *ptr, size_t size);
 int memory_protect_ro(void *ptr, size_t size);
 int memory_remap_fixed(void *old, size_t old_size, void *new, size_t new_size);
+void memory_purge_async_init(void);
+bool memory_purge_async(void *ptr, size_t size, atomic_size_t *completed);
+void memory_purge_async_reap(bool wait);
+void memory_purge_async_fork_child(void);
 
 #endif
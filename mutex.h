@@ -2,14 +2,21 @@
 #define MUTEX_H
 
 #include <pthread.h>
+#include <stdint.h>
 
+#include "config.h"
 #include "util.h"
 
 struct mutex {
     pthread_mutex_t lock;
+#if LOCK_CONTENTION_TRACE
+    // protected by the lock
+    uint64_t acquired;
+    uint64_t contended;
+#endif
 };
 
-#define MUTEX_INITIALIZER (struct mutex){PTHREAD_MUTEX_INITIALIZER}
+#define MUTEX_INITIALIZER (struct mutex){.lock = PTHREAD_MUTEX_INITIALIZER}
 
 static inline void mutex_init(struct mutex *m) {
     if (unlikely(pthread_mutex_init(&m->lock, NULL))) {
@@ -18,7 +25,15 @@ static inline void mutex_init(struct mutex *m) {
 }
 
 static inline void mutex_lock(struct mutex *m) {
+#if LOCK_CONTENTION_TRACE
+    if (pthread_mutex_trylock(&m->lock)) {
+        pthread_mutex_lock(&m->lock);
+        m->contended++;
+    }
+    m->acquired++;
+#else
     pthread_mutex_lock(&m->lock);
+#endif
 }
 
 static inline void mutex_unlock(struct mutex *m) {
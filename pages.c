@@ -80,3 +80,37 @@ void *allocate_pages_aligned(size_t usable_size, size_t alignment, size_t guard_
 
     return base;
 }
+
+// The usable region is rounded up to the huge page size and mapped without a fixed address, with
+// the guards made of regular pages placed around it without replacing any mappings. Nothing outside
+// of the mappings created here is ever unmapped, since another thread may own it.
+void *allocate_pages_huge(size_t usable_size, size_t guard_size, size_t page_size) {
+    if (unlikely(usable_size > SIZE_MAX - page_size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    usable_size = ALIGNMENT_CEILING(usable_size, page_size);
+
+    size_t real_size;
+    if (unlikely(__builtin_add_overflow(usable_size, guard_size * 2, &real_size))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char *usable = memory_map_huge(usable_size, page_size);
+    if (usable == NULL) {
+        return NULL;
+    }
+
+    if (memory_map_noreplace(usable - guard_size, guard_size)) {
+        memory_unmap(usable, usable_size);
+        return NULL;
+    }
+
+    if (memory_map_noreplace(usable + usable_size, guard_size)) {
+        memory_unmap(usable - guard_size, guard_size + usable_size);
+        return NULL;
+    }
+
+    return usable;
+}
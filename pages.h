@@ -12,5 +12,6 @@
 void *allocate_pages(size_t usable_size, size_t guard_size, bool unprotect);
 void deallocate_pages(void *usable, size_t usable_size, size_t guard_size);
 void *allocate_pages_aligned(size_t usable_size, size_t alignment, size_t guard_size);
+void *allocate_pages_huge(size_t usable_size, size_t guard_size, size_t page_size);
 
 #endif
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Build hardened_malloc.so with profile-guided optimization:
+#
+# 1. build the plain library and keep a copy for comparison
+# 2. build an instrumented library and run the training workload with it
+# 3. rebuild using the collected profile
+# 4. report the measured gain of the optimized build against the plain build
+
+set -o errexit -o nounset -o pipefail
+
+dir="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+root="$(dirname "$dir")"
+profile="$dir/profile"
+runs="${PGO_RUNS:-5}"
+cc="${CC:-cc}"
+
+make -C "$dir" train
+
+if "$cc" --version | grep -q clang; then
+    generate="-fprofile-generate=$profile"
+    use="-fprofile-use=$profile/default.profdata"
+else
+    generate="-fprofile-generate=$profile -fprofile-update=atomic"
+    use="-fprofile-use=$profile -fprofile-correction -Wno-missing-profile"
+fi
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+
+make -C "$root" clean
+make -C "$root"
+cp "$root/hardened_malloc.so" "$tmp/plain.so"
+
+rm -rf "$profile"
+make -C "$root" clean
+CFLAGS="$generate" make -C "$root"
+LD_PRELOAD="$root/hardened_malloc.so" "$dir/train" > /dev/null
+
+if "$cc" --version | grep -q clang; then
+    llvm-profdata merge -output="$profile/default.profdata" "$profile"/*.profraw
+fi
+
+make -C "$root" clean
+CFLAGS="$use" make -C "$root"
+cp "$root/hardened_malloc.so" "$tmp/pgo.so"
+
+# best of several runs to filter out noise from other activity on the machine
+best() {
+    local best=
+    for ((i = 0; i < runs; i++)); do
+        local t="$(LD_PRELOAD="$1" "$dir/train")"
+        if [[ -z $best ]] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+plain="$(best "$tmp/plain.so")"
+pgo="$(best "$tmp/pgo.so")"
+
+echo
+echo "plain: ${plain}s"
+echo "pgo:   ${pgo}s"
+awk "BEGIN { printf \"gain:  %.2f%%\n\", ($plain - $pgo) / $plain * 100 }"
@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Training workload for profile-guided optimization. It needs to cover the
+// common paths in roughly the proportions seen in real programs: mostly small
+// allocations served from partial slabs, with slab turnover, occasional large
+// allocations, reallocation growth and aligned allocations mixed in.
+
+#define THREADS 4
+#define SLOTS 4096
+#define ITERATIONS 1000000
+
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static size_t random_size(uint64_t *state) {
+    uint64_t r = next(state);
+    switch (r % 32) {
+    case 0:
+        return 16385 + (r >> 8) % (256 * 1024);
+    case 1: case 2:
+        return 1025 + (r >> 8) % 15360;
+    case 3: case 4: case 5: case 6:
+        return 129 + (r >> 8) % 896;
+    default:
+        return (r >> 8) % 129;
+    }
+}
+
+static void *worker(void *arg) {
+    uint64_t state = (uintptr_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+    void **p = calloc(SLOTS, sizeof(void *));
+    size_t *sizes = calloc(SLOTS, sizeof(size_t));
+    if (p == NULL || sizes == NULL) {
+        abort();
+    }
+
+    for (unsigned i = 0; i < ITERATIONS; i++) {
+        size_t index = next(&state) % SLOTS;
+        if (p[index] != NULL) {
+            if (next(&state) % 8 == 0 && sizes[index] < 64 * 1024) {
+                size_t size = sizes[index] + sizes[index] / 2 + 16;
+                void *q = realloc(p[index], size);
+                if (q == NULL) {
+                    abort();
+                }
+                p[index] = q;
+                sizes[index] = size;
+            } else {
+                free(p[index]);
+                p[index] = NULL;
+            }
+            continue;
+        }
+
+        size_t size = random_size(&state);
+        switch (next(&state) % 16) {
+        case 0:
+            p[index] = calloc(1, size);
+            break;
+        case 1:
+            p[index] = aligned_alloc(64, size);
+            break;
+        default:
+            p[index] = malloc(size);
+        }
+        if (p[index] == NULL) {
+            abort();
+        }
+        memset(p[index], 0xa5, size < 64 ? size : 64);
+        sizes[index] = size;
+    }
+
+    for (size_t i = 0; i < SLOTS; i++) {
+        free(p[i]);
+    }
+    free(sizes);
+    free(p);
+    return NULL;
+}
+
+int main(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, worker, (void *)i)) {
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%.6f\n", (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "pressure.h"
+
+// 100ms of stall within a 2 second window, which is the finest window available to unprivileged
+// processes for PSI triggers
+static const char trigger[] = "some 100000 2000000";
+
+static const char system_pressure[] = "/proc/pressure/memory";
+
+static int open_trigger(const char *path) {
+    int fd = open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (write(fd, trigger, sizeof(trigger)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// register a memory pressure trigger, preferring the cgroup of the process over the system-wide
+// pressure since that's what determines when the OOM killer acts in a container
+int pressure_open(void) {
+    char path[PATH_MAX];
+    if (!cgroup_path(path, sizeof(path), "memory.pressure")) {
+        int fd = open_trigger(path);
+        if (fd != -1) {
+            return fd;
+        }
+    }
+    return open_trigger(system_pressure);
+}
+
+// returns 1 for a pressure event, 0 for a timeout and -1 if the trigger is gone
+int pressure_wait(int fd, int timeout) {
+    struct pollfd pfd = {.fd = fd, .events = POLLPRI};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1 || pfd.revents & POLLERR) {
+        return -1;
+    }
+    return ret;
+}
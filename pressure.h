@@ -0,0 +1,7 @@
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+int pressure_open(void);
+int pressure_wait(int fd, int timeout);
+
+#endif
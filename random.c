@@ -1,6 +1,8 @@
 #include <errno.h>
+#include <stdatomic.h>
 #include <string.h>
 
+#include "config.h"
 #include "random.h"
 #include "util.h"
 
@@ -18,7 +20,34 @@ static ssize_t getrandom(void *buf, size_t buflen, unsigned int flags) {
 
 #include "chacha.h"
 
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+// Test-only replacement for the OS entropy, deriving each seed from RANDOM_SEED and the number of
+// seeds handed out before it. Initialization is single-threaded, so the sequence of random states
+// receiving them is the same across runs.
+static void get_deterministic_seed(void *buf, size_t size) {
+    static atomic_uint_fast64_t seeds;
+    uint64_t state = RANDOM_SEED + atomic_fetch_add_explicit(&seeds, 1, memory_order_relaxed) * size;
+    while (size > 0) {
+        uint64_t value = splitmix64(&state);
+        size_t n = size < sizeof(value) ? size : sizeof(value);
+        memcpy(buf, &value, n);
+        buf = (char *)buf + n;
+        size -= n;
+    }
+}
+
 static void get_random_seed(void *buf, size_t size) {
+    if (DETERMINISTIC_RANDOM) {
+        get_deterministic_seed(buf, size);
+        return;
+    }
+
     while (size > 0) {
         ssize_t r;
 
@@ -35,9 +64,7 @@ static void get_random_seed(void *buf, size_t size) {
     }
 }
 
-void random_state_init(struct random_state *state) {
-    uint8_t rnd[CHACHA_KEY_SIZE + CHACHA_IV_SIZE];
-    get_random_seed(rnd, sizeof(rnd));
+static void random_state_setup(struct random_state *state, const uint8_t *rnd) {
     chacha_keysetup(&state->ctx, rnd);
     chacha_ivsetup(&state->ctx, rnd + CHACHA_KEY_SIZE);
     chacha_keystream_bytes(&state->ctx, state->cache, RANDOM_CACHE_SIZE);
@@ -45,12 +72,24 @@ void random_state_init(struct random_state *state) {
     state->reseed = 0;
 }
 
+void random_state_init(struct random_state *state) {
+    uint8_t rnd[CHACHA_KEY_SIZE + CHACHA_IV_SIZE];
+    get_random_seed(rnd, sizeof(rnd));
+    random_state_setup(state, rnd);
+}
+
 static void refill(struct random_state *state) {
     if (state->reseed < RANDOM_RESEED_SIZE) {
         chacha_keystream_bytes(&state->ctx, state->cache, RANDOM_CACHE_SIZE);
         state->index = 0;
         state->reseed += RANDOM_CACHE_SIZE;
+    } else if (DETERMINISTIC_RANDOM) {
+        // reseeding happens in whatever order the threads get there, so it can't use a new seed
+        uint8_t rnd[CHACHA_KEY_SIZE + CHACHA_IV_SIZE];
+        chacha_keystream_bytes(&state->ctx, rnd, sizeof(rnd));
+        random_state_setup(state, rnd);
     } else {
+        trace_slow_path(SLOW_PATH_RESEED);
         random_state_init(state);
     }
 }
@@ -8,11 +8,12 @@
 #define RANDOM_CACHE_SIZE 256ULL
 #define RANDOM_RESEED_SIZE 256ULL * 1024
 
+// the cipher state is only used to refill the cache, so it's placed after it
 struct random_state {
     size_t index;
     size_t reseed;
-    chacha_ctx ctx;
     uint8_t cache[RANDOM_CACHE_SIZE];
+    chacha_ctx ctx;
 };
 
 void random_state_init(struct random_state *state);
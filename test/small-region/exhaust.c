@@ -0,0 +1,80 @@
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fill each small size class until the allocator runs out of slabs and check that every slot is
+// distinct, writable and freeable, then that the slabs are reusable after freeing them.
+
+#define MAX_ALLOCATIONS (1024 * 1024)
+
+static const size_t sizes[] = {
+    1, 16, 24, 48, 64, 80, 112, 128, 200, 256, 400, 512, 1000, 1024, 1500, 2048,
+    3000, 3500, 4096, 6000, 8000, 12000, 14000, 16376
+};
+
+static void *p[MAX_ALLOCATIONS];
+
+static int compare(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+static size_t fill(size_t size) {
+    size_t n = 0;
+    while (n < MAX_ALLOCATIONS) {
+        void *q = malloc(size);
+        if (q == NULL) {
+            break;
+        }
+        memset(q, 0xa5, size);
+        p[n++] = q;
+    }
+    return n;
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t size = sizes[i];
+        size_t n = fill(size);
+        if (n == 0 || n == MAX_ALLOCATIONS) {
+            fprintf(stderr, "size %zu: unexpected allocation count %zu\n", size, n);
+            return 1;
+        }
+
+        // slabs past the end of the size class region would be in the next one or its guard gap
+        qsort(p, n, sizeof(void *), compare);
+        if ((char *)p[n - 1] - (char *)p[0] >= CLASS_REGION_SIZE) {
+            fprintf(stderr, "size %zu: slots span more than the size class region\n", size);
+            return 1;
+        }
+
+        size_t usable = malloc_usable_size(p[0]);
+        for (size_t j = 1; j < n; j++) {
+            if ((char *)p[j - 1] + usable > (char *)p[j]) {
+                fprintf(stderr, "size %zu: overlapping slots %p and %p\n", size, p[j - 1], p[j]);
+                return 1;
+            }
+        }
+
+        for (size_t j = 0; j < n; j++) {
+            free(p[j]);
+        }
+        malloc_trim(0);
+
+        size_t reused = fill(size);
+        for (size_t j = 0; j < reused; j++) {
+            free(p[j]);
+        }
+        malloc_trim(0);
+        if (reused != n) {
+            fprintf(stderr, "size %zu: %zu slots before freeing, %zu after\n", size, n, reused);
+            return 1;
+        }
+
+        printf("size %zu: %zu slots\n", size, n);
+    }
+    return 0;
+}
@@ -6,6 +6,10 @@
 
 #include "util.h"
 
+#if SLOW_PATH_TRACE
+_Thread_local uint64_t slow_path_counts[N_SLOW_PATHS];
+#endif
+
 static int write_full(int fd, const char *buf, size_t length) {
     do {
         ssize_t bytes_written = write(fd, buf, length);
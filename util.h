@@ -1,8 +1,11 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
 #include <stdnoreturn.h>
 
+#include "config.h"
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -19,4 +22,25 @@ static inline int ffzl(long x) {
 
 COLD noreturn void fatal_error(const char *s);
 
+// matching the H_MALLOC_SLOW_* indices for h_malloc_slow_paths
+enum slow_path {
+    SLOW_PATH_METADATA,
+    SLOW_PATH_REACTIVATE,
+    SLOW_PATH_PURGE,
+    SLOW_PATH_REGIONS_GROW,
+    SLOW_PATH_RESEED,
+    SLOW_PATH_QUARANTINE_BATCH,
+    N_SLOW_PATHS
+};
+
+#if SLOW_PATH_TRACE
+extern _Thread_local uint64_t slow_path_counts[N_SLOW_PATHS];
+#endif
+
+static inline void trace_slow_path(UNUSED enum slow_path path) {
+#if SLOW_PATH_TRACE
+    slow_path_counts[path]++;
+#endif
+}
+
 #endif